@@ -0,0 +1,826 @@
+/*
+
+   xc-bench.c	V1.1
+   Copyright - Neil Verplank 2016, 2017, 2020 (c)
+   neil@capnnemosflamingcarnival.org
+
+
+	Benchmark client for xc-socket-server.  Stands in for a set of
+	effects (and a button, and controllers with collections) on
+	a single machine, so we can measure the server without the
+	carnival attached.  Two runs:
+
+	A "dense round" (the default):  N effects connect and register,
+	the button starts a big round (B:2:1) and toggles The Button
+	(B:1:1 / B:1:0), while a controller effect forwards to its
+	collection (all N effects) as fast as it's allowed.  That's the
+	case where several messages for one effect coincide in one pass
+	of the server's main loop.
+
+	At the end we report messages received by the effects, and the
+	number of data segments (packets) that carried them, taken from
+	the kernel (TCP_INFO) on each effect's socket.  Every segment is
+	a wifi frame on the real network, so the difference between the
+	two is airtime saved, estimated at WIFI_FRAME_US per frame.
+
+	A "load" run:  N clients (10 to 5000) connect and register the
+	way the huzzahs do, and keep sending keep-alives.  Controllers,
+	one per GROUP clients, each set a collection (CC) of their group
+	and take turns forwarding numbered messages to it, the button
+	toggles The Button for everyone and starts a round now and then.
+	Every client timestamps what it receives, so we get end-to-end
+	latency (send to receipt, all on this machine's clock) for the
+	forwards and The Button, percentiles in microseconds, plus
+	throughput and how many deliveries never showed up.  Run it
+	before each burn season, and compare against the last one.
+
+	A "storm" run:  N clients connect and register, then - as when
+	the access point reboots - all drop at once and all reconnect at
+	once, each asking for a clock sync (TS) as soon as it's in, the
+	answer proving it's online.  We report how long it took to bring
+	them all back, percentiles across the clients, and how many had
+	to try again.  Several rounds, as the kernel's SYN retransmits
+	(1s, 3s...) make it lumpy.  Compare the server's -B backlog
+	settings, or builds, with it.
+
+	NOTE the server uses select(), so clients past FD_SETSIZE (1024,
+	less the server's own) are turned away - they're reported as
+	refused.  Raise the open files limit (ulimit -n) for big runs.
+
+	To compile:
+
+	    gcc -o xc-bench xc-bench.c -Wall
+
+	and run against a server on this machine:
+
+	    ./xc-bench [effects] [seconds] [host]
+	    ./xc-bench load [clients] [seconds] [host]
+	    ./xc-bench storm [clients] [rounds] [host]
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>       /* open files limit             */
+#include <netinet/in.h>         /* Internet address structures  */
+#include <arpa/inet.h>
+#include <linux/tcp.h>          /* TCP_NODELAY, TCP_INFO        */
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+
+#define PORT            5061            /* port of our xc-socket-server         */
+#define BUFLEN          1024            /* read buffer                          */
+#define MAXEFFECTS      5000            /* most effects we'll stand in for      */
+#define FWD_EVERY       5               /* ms between collection forwards       */
+#define BUT_EVERY       50              /* ms between button changes            */
+#define WIFI_FRAME_US   250             /* rough airtime of one small frame+ack */
+
+#define GROUP           50              /* (load) clients per controller        */
+#define KA_EVERY        1000            /* (load) ms between a client's keep-alives */
+#define LOAD_BUT_EVERY  100             /* (load) ms between button changes     */
+#define ROUND_EVERY     5000            /* (load) ms between rounds             */
+#define SEQ_RING        65536           /* (load) forwards we remember send times for */
+#define PARTLEN         32              /* (load) longest message we time       */
+#define CONNECT_GAP     1               /* (load) ms between connects, the server takes one a pass */
+
+#define STORM_WAIT      30000           /* (storm) ms we give everyone to come back */
+#define STORM_RETRY     500             /* (storm) ms a client waits to retry a failed connect */
+#define STORM_QUIET     1000            /* (storm) ms between rounds */
+
+#define HDR_SUB_BITS    6               /* latency histogram, same as the server's */
+#define HDR_BUCKETS     736
+
+
+int     numEffects  = 12;               /* effects to stand in for  */
+int     seconds     = 5;                /* length of the run        */
+char   *host        = "127.0.0.1";      /* where the server is      */
+
+int     effectSock[MAXEFFECTS];         /* effects' sockets         */
+long    effectMsgs[MAXEFFECTS];         /* messages each received   */
+long    effectSegs[MAXEFFECTS];         /* data segments at start   */
+
+
+/* (load) what each client has half-read, and what we've measured */
+typedef struct _client_t_ {
+    int     open;                       /* still connected          */
+    int     part_len;
+    char    part[PARTLEN];              /* message split across reads */
+    long    butSeen;                    /* last button change it got  */
+} client_t;
+
+typedef struct _hdr_t_ {
+    long    count;
+    long    max;
+    long    buckets[HDR_BUCKETS];
+} hdr_t;
+
+client_t client[MAXEFFECTS];
+long     sentAt[SEQ_RING];              /* when each forward went out, us   */
+long     butAt;                         /* when The Button last changed     */
+long     butGen;                        /* and how many times it has        */
+int      butOn;                         /* and to what                      */
+long     received;                      /* messages received, all clients   */
+long     fwdGot, butGot;                /* deliveries we could time         */
+long     refused;                       /* clients the server closed on us  */
+hdr_t    fwdLat, butLat;                /* end-to-end latency, us           */
+
+
+
+/*      OUR SUBROUTINES     */
+
+int     getSock();
+void    send_msg(int sock, char *msg);
+int     data_segs_in(int sock);
+void    read_effects(int wait_ms);
+long    millis();
+long    micros();
+
+int     dense_round();
+int     load_test();
+int     storm_test();
+int     storm_round(long *online, int *retries);
+void    open_files(int want);
+void    read_clients(int wait_ms);
+void    got_msg(client_t *c, char *msg, long now);
+void    hdr_record(hdr_t *h, long value);
+long    hdr_percentile(hdr_t *h, double percentile);
+void    report_latency(char *what, hdr_t *h, long expected);
+
+
+
+
+/*      MAIN                */
+
+int main(int argc, char **argv) {
+
+    int load  = (argc > 1 && strcmp(argv[1], "load") == 0);
+    int storm = (argc > 1 && strcmp(argv[1], "storm") == 0);
+
+    if (load)  { argc--; argv++; numEffects = 100; }
+    if (storm) { argc--; argv++; numEffects = 500; seconds = 3; }   // seconds is rounds, here
+
+    if (argc > 1) numEffects = atoi(argv[1]);
+    if (argc > 2) seconds    = atoi(argv[2]);
+    if (argc > 3) host       = argv[3];
+    if (numEffects < 1 || numEffects > MAXEFFECTS) numEffects = 12;
+
+    if (storm) return storm_test();
+    return load ? load_test() : dense_round();
+}
+
+
+
+
+/* DENSE ROUND  */
+
+
+int dense_round() {
+
+    int     i;
+    char    msg[2*BUFLEN];
+    char    collection[BUFLEN];
+
+    if (numEffects > 150) numEffects = 150;             // the collection has to fit in a message
+
+    // the button, and a controller, neither wants to hear anything back
+    int button     = getSock();
+    int controller = getSock();
+    send_msg(button, "B:*:DS:1");
+    send_msg(controller, "CTL:*:DS:1");
+
+    // register the effects, and give the controller a collection of all of them
+    collection[0] = '\0';
+    for (i=0; i<numEffects; i++) {
+        effectSock[i] = getSock();
+        effectMsgs[i] = 0L;
+        sprintf(msg, "E%02d:KA", i);
+        send_msg(effectSock[i], msg);
+        sprintf(msg, "%sE%02d", (i ? "," : ""), i);
+        strcat(collection, msg);
+    }
+    sprintf(msg, "CTL:*:CC:%s", collection);
+    send_msg(controller, msg);
+
+    read_effects(200);
+    for (i=0; i<numEffects; i++) {
+        effectMsgs[i] = 0L;
+        effectSegs[i] = data_segs_in(effectSock[i]);
+    }
+
+    // and go.
+    long start   = millis();
+    long lastFwd = 0L;
+    long lastBut = 0L;
+    long now     = start;
+    int  butOn   = 0;
+
+    send_msg(button, "B:2:1");
+
+    while ((now = millis()) - start < seconds*1000L) {
+
+        if (now - lastFwd >= FWD_EVERY) {
+            send_msg(controller, "CTL:$p2%");
+            lastFwd = now;
+        }
+
+        if (now - lastBut >= BUT_EVERY) {
+            butOn = !butOn;
+            send_msg(button, butOn ? "B:1:1" : "B:1:0");
+            lastBut = now;
+        }
+
+        read_effects(1);
+    }
+
+    send_msg(button, "B:1:0");
+    read_effects(100);
+
+    long elapsed = millis() - start;
+    long msgs    = 0L;
+    long segs    = 0L;
+
+    for (i=0; i<numEffects; i++) {
+        msgs += effectMsgs[i];
+        segs += data_segs_in(effectSock[i]) - effectSegs[i];
+        close(effectSock[i]);
+    }
+    close(button);
+    close(controller);
+
+    double secs = elapsed / 1000.0;
+
+    printf("effects:              %d\n", numEffects);
+    printf("seconds:              %.2f\n", secs);
+    printf("messages received:    %ld  (%.0f/s)\n", msgs, msgs/secs);
+    printf("data segments:        %ld  (%.0f/s)\n", segs, segs/secs);
+    printf("messages per segment: %.2f\n", segs ? (double)msgs/segs : 0.0);
+    printf("est. airtime saved:   %.1f ms  (%.1f ms/s, at %d us/frame)\n",
+           (msgs-segs)*WIFI_FRAME_US/1000.0, (msgs-segs)*WIFI_FRAME_US/1000.0/secs, WIFI_FRAME_US);
+
+    return 0;
+}
+
+
+
+
+/* LOAD TEST  */
+
+
+int load_test() {
+
+    int     i, j;
+    char    msg[2*BUFLEN];
+    char    collection[BUFLEN];
+    int     groups = (numEffects + GROUP - 1)/GROUP;
+    int     controller[MAXEFFECTS/GROUP + 1];
+
+    // a socket for everyone, and a few to spare
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)(numEffects + groups + 16)) {
+        rl.rlim_cur = (rl.rlim_max < (rlim_t)(numEffects + groups + 16)) ? rl.rlim_max : (rlim_t)(numEffects + groups + 16);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)(numEffects + groups + 16)) {
+        numEffects = rl.rlim_cur - groups - 16;
+        groups     = (numEffects + GROUP - 1)/GROUP;
+        fprintf(stderr, "open files limit - only %d clients\n", numEffects);
+    }
+
+    // the button, and controllers, don't want to hear anything back
+    int button = getSock();
+    send_msg(button, "B:*:DS:1");
+
+    // controllers first, so the server can't turn them away.  collections fill in as clients show up
+    long setup = millis();
+    for (j=0; j<groups; j++) {
+        controller[j] = getSock();
+        sprintf(msg, "C%03d:*:DS:1", j);
+        send_msg(controller[j], msg);
+        collection[0] = '\0';
+        for (i=j*GROUP; i<(j+1)*GROUP && i<numEffects; i++) {
+            sprintf(msg, "%sL%04d", (i > j*GROUP ? "," : ""), i);
+            strcat(collection, msg);
+        }
+        sprintf(msg, "C%03d:*:CC:%s", j, collection);
+        send_msg(controller[j], msg);
+    }
+
+    for (i=0; i<numEffects; i++) {
+        effectSock[i]      = getSock();
+        client[i].open     = 1;
+        client[i].part_len = 0;
+        client[i].butSeen  = 0L;
+        sprintf(msg, "L%04d:KA", i);
+        send_msg(effectSock[i], msg);
+        read_clients(CONNECT_GAP);                      // let anything that closed on us, close
+    }
+    setup = millis() - setup;
+
+    read_clients(500);
+
+    // count from here
+    received = fwdGot = butGot = 0L;
+    memset(&fwdLat, 0, sizeof(hdr_t));
+    memset(&butLat, 0, sizeof(hdr_t));
+
+    int  connected = 0;
+    for (i=0; i<numEffects; i++) connected += client[i].open;
+
+    long start     = millis();
+    long lastFwd   = 0L;
+    long lastBut   = 0L;
+    long lastRound = start;
+    long now       = start;
+    long seq       = 0L;
+    long fwds      = 0L;
+    long fwdWant   = 0L;
+    long butWant   = 0L;
+    int  nextKA    = 0;
+    int  open      = connected;
+
+    while ((now = millis()) - start < seconds*1000L) {
+
+        // controllers take turns forwarding a numbered message to their group
+        if (now - lastFwd >= FWD_EVERY) {
+            j = fwds % groups;
+            sprintf(msg, "C%03d:$q%ld%%", j, seq);
+            sentAt[seq % SEQ_RING] = micros();
+            send_msg(controller[j], msg);
+            for (i=j*GROUP; i<(j+1)*GROUP && i<numEffects; i++)
+                fwdWant += client[i].open;
+            seq++;
+            fwds++;
+            lastFwd = now;
+        }
+
+        // The Button, for everyone
+        if (now - lastBut >= LOAD_BUT_EVERY) {
+            butOn  = !butOn;
+            butAt  = micros();
+            butGen++;
+            send_msg(button, butOn ? "B:1:1" : "B:1:0");
+            butWant += open;
+            lastBut = now;
+        }
+
+        // and a round now and then, for the traffic
+        if (now - lastRound >= ROUND_EVERY) {
+            send_msg(button, "B:2:1");
+            lastRound = now;
+        }
+
+        // everyone says they're alive once every KA_EVERY, spread out
+        int due = (int)((long)numEffects * (now - start) / KA_EVERY);
+        while (nextKA < due) {
+            i = nextKA++ % numEffects;
+            if (!client[i].open) continue;
+            sprintf(msg, "L%04d:KA", i);
+            send_msg(effectSock[i], msg);
+        }
+
+        read_clients(1);
+
+        open = 0;
+        for (i=0; i<numEffects; i++) open += client[i].open;
+    }
+
+    send_msg(button, "B:1:0");
+    long elapsed = millis() - start;
+    read_clients(500);
+
+    for (i=0; i<numEffects; i++)
+        if (client[i].open) close(effectSock[i]);
+    for (j=0; j<groups; j++)
+        close(controller[j]);
+    close(button);
+
+    double secs = elapsed / 1000.0;
+
+    printf("clients:              %d  (%d connected, %d controllers, setup %.2f s)\n",
+           numEffects, connected, groups, setup/1000.0);
+    printf("refused/closed:       %ld\n", refused);
+    printf("seconds:              %.2f\n", secs);
+    printf("messages received:    %ld  (%.0f/s)\n", received, received/secs);
+    printf("forwards sent:        %ld  (%.0f/s)\n", fwds, fwds/secs);
+    report_latency("forward", &fwdLat, fwdWant);
+    report_latency("button",  &butLat, butWant);
+
+    return 0;
+}
+
+
+
+/* STORM  */
+
+
+int storm_test() {
+
+    int     i, r, retries;
+    char    msg[BUFLEN];
+    long   *online = malloc(numEffects*sizeof(long));
+    hdr_t   all;
+
+    open_files(2*numEffects + 16);
+
+    // everyone on, the gentle way
+    for (i=0; i<numEffects; i++) {
+        effectSock[i] = getSock();
+        sprintf(msg, "S%04d:KA", i);
+        send_msg(effectSock[i], msg);
+        usleep(CONNECT_GAP*1000);
+    }
+    usleep(500000);
+
+    memset(&all, 0, sizeof(all));
+    printf("clients:              %d\n", numEffects);
+
+    for (r=0; r<seconds; r++) {
+
+        int  back = storm_round(online, &retries);
+        long last = 0L;
+        hdr_t h;
+
+        memset(&h, 0, sizeof(h));
+        for (i=0; i<numEffects; i++) {
+            if (online[i] < 0) continue;
+            hdr_record(&h, online[i]);
+            hdr_record(&all, online[i]);
+            if (online[i] > last) last = online[i];
+        }
+
+        printf("round %d:              %d of %d back in %.1f ms  (p50 %.1f  p90 %.1f  p99 %.1f ms)  retries %d\n",
+               r+1, back, numEffects, last/1000.0,
+               hdr_percentile(&h, 50.0)/1000.0, hdr_percentile(&h, 90.0)/1000.0,
+               hdr_percentile(&h, 99.0)/1000.0, retries);
+
+        usleep(STORM_QUIET*1000);
+    }
+
+    printf("online after storm:   p50 %.1f  p90 %.1f  p99 %.1f  max %.1f ms\n",
+           hdr_percentile(&all, 50.0)/1000.0, hdr_percentile(&all, 90.0)/1000.0,
+           hdr_percentile(&all, 99.0)/1000.0, all.max/1000.0);
+
+    for (i=0; i<numEffects; i++)
+        if (effectSock[i] >= 0) close(effectSock[i]);
+    free(online);
+
+    return 0;
+}
+
+
+
+/*
+    Everyone drops, and everyone reconnects - non-blocking, all at once -
+    then registers and asks for a clock sync.  online[i] is how long until
+    client i had its answer, us, or -1 if it never did.  Returns how many
+    made it back.
+*/
+int storm_round(long *online, int *retries) {
+
+    static struct pollfd fds[MAXEFFECTS];
+    static int           state[MAXEFFECTS];        // 0 connecting, 1 waiting for TS, 2 online, 3 retry later
+    static long          retry_at[MAXEFFECTS];
+    struct sockaddr_in   servaddr;
+    char                 msg[BUFLEN], buf[BUFLEN];
+    int                  i, rc, flag = 1, back = 0;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port   = htons(PORT);
+    inet_pton(AF_INET, host, &(servaddr.sin_addr));
+
+    *retries = 0;
+
+    for (i=0; i<numEffects; i++)
+        if (effectSock[i] >= 0) close(effectSock[i]);
+
+    long start = micros();
+
+    for (i=0; i<numEffects; i++) {
+        online[i]   = -1;
+        state[i]    = 3;
+        retry_at[i] = start;
+        effectSock[i] = -1;
+    }
+
+    while (back < numEffects && micros() - start < STORM_WAIT*1000L) {
+
+        long now = micros();
+
+        // (re)connect whoever's due
+        for (i=0; i<numEffects; i++) {
+            if (state[i] != 3 || now < retry_at[i]) continue;
+            effectSock[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            setsockopt(effectSock[i], IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+            if (connect(effectSock[i], (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0 && errno != EINPROGRESS) {
+                close(effectSock[i]);
+                effectSock[i] = -1;
+                retry_at[i]   = now + STORM_RETRY*1000L;
+                (*retries)++;
+                continue;
+            }
+            state[i] = 0;
+        }
+
+        for (i=0; i<numEffects; i++) {
+            fds[i].fd      = (state[i] < 2) ? effectSock[i] : -1;
+            fds[i].events  = (state[i] == 0) ? POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, numEffects, 1) < 1) continue;
+
+        now = micros();
+
+        for (i=0; i<numEffects; i++) {
+
+            if (!fds[i].revents) continue;
+
+            // connected - or not
+            if (state[i] == 0) {
+                int       err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(effectSock[i], SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err) {
+                    close(effectSock[i]);
+                    effectSock[i] = -1;
+                    state[i]      = 3;
+                    retry_at[i]   = now + STORM_RETRY*1000L;
+                    (*retries)++;
+                    continue;
+                }
+                sprintf(msg, "S%04d:*:TS:%ld", i, now);
+                send_msg(effectSock[i], msg);
+                state[i] = 1;
+                continue;
+            }
+
+            // the answer - or the server closing on us
+            rc = read(effectSock[i], buf, BUFLEN);
+            if (rc > 2 && strncmp(buf, "$ts", 3) == 0) {
+                online[i] = now - start;
+                state[i]  = 2;
+                back++;
+            } else if (rc == 0 || (rc < 0 && errno != EAGAIN)) {
+                close(effectSock[i]);
+                effectSock[i] = -1;
+                state[i]      = 3;
+                retry_at[i]   = now + STORM_RETRY*1000L;
+                (*retries)++;
+            }
+        }
+    }
+
+    // and back to blocking, for the next round's close
+    for (i=0; i<numEffects; i++)
+        if (effectSock[i] >= 0) fcntl(effectSock[i], F_SETFL, 0);
+
+    return back;
+}
+
+
+
+/* a socket for everyone, and a few to spare - as many as we're allowed */
+void open_files(int want) {
+
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)want) {
+        rl.rlim_cur = (rl.rlim_max < (rlim_t)want) ? rl.rlim_max : (rlim_t)want;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)want) {
+        numEffects = (rl.rlim_cur - 16)/2;
+        fprintf(stderr, "open files limit - only %d clients\n", numEffects);
+    }
+}
+
+
+
+/* read whatever has arrived for the clients, timing what we can */
+void read_clients(int wait_ms) {
+
+    static struct pollfd fds[MAXEFFECTS];
+    char   buf[BUFLEN];
+    int    i, j, rc, nfds = 0;
+    int    which[MAXEFFECTS];
+
+    for (i=0; i<numEffects; i++) {
+        if (!client[i].open) continue;
+        fds[nfds].fd     = effectSock[i];
+        fds[nfds].events = POLLIN;
+        which[nfds++]    = i;
+    }
+
+    if (poll(fds, nfds, wait_ms) < 1) return;
+
+    long now = micros();
+
+    for (j=0; j<nfds; j++) {
+
+        if (!(fds[j].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        client_t *c = &client[which[j]];
+
+        rc = read(fds[j].fd, buf, BUFLEN);
+        if (rc < 1) {
+            close(fds[j].fd);
+            c->open = 0;
+            refused++;
+            continue;
+        }
+
+        for (i=0; i<rc; i++) {
+            if (buf[i] == '\0') {
+                c->part[c->part_len] = '\0';
+                got_msg(c, c->part, now);
+                c->part_len = 0;
+            } else if (c->part_len < PARTLEN-1) {
+                c->part[c->part_len++] = buf[i];
+            }
+        }
+    }
+}
+
+
+
+/*
+    A client got a message - if it's one we sent, how long did it take?
+    Rounds poof with the same messages as The Button, so only the first
+    one a client gets after each change counts.
+*/
+void got_msg(client_t *c, char *msg, long now) {
+
+    received++;
+
+    if (strncmp(msg, "$q", 2) == 0) {
+        long seq = atol(msg+2);
+        hdr_record(&fwdLat, now - sentAt[seq % SEQ_RING]);
+        fwdGot++;
+    } else if (c->butSeen != butGen && strcmp(msg, butOn ? "$p1%" : "$p0%") == 0) {
+        hdr_record(&butLat, now - butAt);
+        c->butSeen = butGen;
+        butGot++;
+    }
+}
+
+
+
+/* one line of latency percentiles, and how many deliveries went missing */
+void report_latency(char *what, hdr_t *h, long expected) {
+
+    printf("%-8s latency us:    p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  max %ld  (%ld of %ld delivered, %.2f%%)\n",
+           what,
+           hdr_percentile(h, 50.0), hdr_percentile(h, 90.0), hdr_percentile(h, 99.0),
+           hdr_percentile(h, 99.9), h->max,
+           h->count, expected, expected ? 100.0*h->count/expected : 0.0);
+}
+
+
+
+
+/* SUBROUTINES  */
+
+
+/* get a socket connected to the server, without Nagle */
+int getSock() {
+
+    struct sockaddr_in servaddr;
+    int    flag = 1;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port   = htons(PORT);
+    inet_pton(AF_INET, host, &(servaddr.sin_addr));
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+
+    return sockfd;
+}
+
+
+
+/* messages to the server are null terminated, same as the huzzahs do */
+void send_msg(int sock, char *msg) {
+    send(sock, msg, strlen(msg)+1, MSG_NOSIGNAL);
+}
+
+
+
+/* data segments received on a socket so far, per the kernel */
+int data_segs_in(int sock) {
+
+    struct tcp_info info;
+    socklen_t       len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return 0;
+
+    return info.tcpi_data_segs_in;
+}
+
+
+
+/* read whatever has arrived for the effects, counting messages (null terminated) */
+void read_effects(int wait_ms) {
+
+    struct pollfd fds[MAXEFFECTS];
+    char          buf[BUFLEN];
+    int           i, j, rc;
+
+    for (i=0; i<numEffects; i++) {
+        fds[i].fd     = effectSock[i];
+        fds[i].events = POLLIN;
+    }
+
+    if (poll(fds, numEffects, wait_ms) < 1) return;
+
+    for (i=0; i<numEffects; i++) {
+        if (!(fds[i].revents & POLLIN)) continue;
+        rc = read(effectSock[i], buf, BUFLEN);
+        for (j=0; j<rc; j++)
+            if (buf[j] == '\0') effectMsgs[i]++;
+    }
+}
+
+
+
+/* record a value in a log-linear histogram (see the server's hdr_record()) */
+void hdr_record(hdr_t *h, long value) {
+
+    int index;
+
+    if (value < 0) value = 0;
+
+    if (value < (1L << HDR_SUB_BITS)) {
+        index = (int)value;
+    } else {
+        int shift = (63 - __builtin_clzll((unsigned long long)value)) - (HDR_SUB_BITS-1);
+        index = shift*(1 << (HDR_SUB_BITS-1)) + (int)(value >> shift);
+        if (index >= HDR_BUCKETS) index = HDR_BUCKETS-1;
+    }
+
+    h->buckets[index]++;
+    h->count++;
+    if (value > h->max) h->max = value;
+}
+
+
+
+/* value at a given percentile (0-100), as the top of its bucket */
+long hdr_percentile(hdr_t *h, double percentile) {
+
+    long target, seen = 0;
+    int  i;
+
+    if (!h->count) return 0;
+
+    target = (long)(percentile/100.0 * h->count + 0.5);
+    if (target < 1) target = 1;
+
+    for (i=0; i<HDR_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            long top = i;
+            if (i >= (1 << HDR_SUB_BITS)) {
+                int shift = i/(1 << (HDR_SUB_BITS-1)) - 1;
+                top = (((long)(i - shift*(1 << (HDR_SUB_BITS-1))) + 1) << shift) - 1;
+            }
+            return (top < h->max) ? top : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+
+
+/* milliseconds on a monotonic clock */
+long millis() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec*1000L + spec.tv_nsec/1000000L;
+}
+
+
+
+/* microseconds, same clock */
+long micros() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec*1000000L + spec.tv_nsec/1000L;
+}
@@ -0,0 +1,461 @@
+/*
+
+   xc-effect.c	V1.0
+   Copyright - Neil Verplank 2016, 2017, 2020 (c)
+   neil@capnnemosflamingcarnival.org
+
+
+	Stand-in for a set of effects (huzzahs), for running against
+	xc-socket-server on one machine, and a harness for measuring how
+	well a round actually lines up at the effects.
+
+	Each stand-in effect connects, registers (E00, E01 ...), and
+	"poofs" on $p1% / $p2%, stops on $p0% / $kill%.  Wifi is faked by
+	holding each incoming message for a random 0..JITTER ms before the
+	effect sees it (in order, same as TCP would).
+
+	With -s each effect first syncs to the server's clock (TS, see
+	sync_clock() in the server), and then gets rounds shipped ahead as
+	timed commands ($@<time>,<cmd>%), which it carries out on the
+	shared clock.  Without it, it poofs whenever a message shows up.
+
+	The button then starts a big round (B:2:1), and at the end we
+	report, for every poof:
+
+	    lateness        - when it happened vs when the server meant it to
+	    interval error  - error in the gap between successive poofs,
+	                      i.e. the inter-effect timing spread
+
+	"when the server meant it" is the timed command's time for synced
+	effects, and the (un-jittered) arrival time for the rest.
+
+	To compile:
+
+	    gcc -o xc-effect xc-effect.c -lm -Wall
+
+	and, with a server running on this machine, compare:
+
+	    ./xc-effect -j 20
+	    ./xc-effect -j 20 -s
+
+	Options:  -n effects (12)  -j jitter ms (0)  -t seconds (20)
+	          -s clock sync    -h host (127.0.0.1)
+
+*/
+
+
+#define _GNU_SOURCE             /* ppoll                        */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>         /* Internet address structures  */
+#include <netinet/tcp.h>        /* TCP_NODELAY                  */
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+
+#define PORT            5061            /* port of our xc-socket-server         */
+#define BUFLEN          1024            /* read buffer                          */
+#define MAXEFFECTS      64              /* most effects we'll stand in for      */
+#define MAXQUEUE        256             /* messages "in the air" per effect     */
+#define MAXTIMED        256             /* timed commands waiting per effect    */
+#define MAXACTS         20000           /* poofs we'll remember                 */
+#define SYNC_TRIES      8               /* TS exchanges per effect              */
+#define CMDLEN          16              /* longest command we keep              */
+
+
+/* a message held back to fake the wifi */
+typedef struct {
+    long long   raw_at;                 /* when it really got here      */
+    long long   deliver_at;             /* when the effect gets to see it */
+    char        msg[64];
+} held_t;
+
+
+/* a timed command, waiting for its time */
+typedef struct {
+    long long   at;                     /* local time to carry it out   */
+    long long   server_at;              /* same, on the server's clock  */
+    char        cmd[CMDLEN];
+} timed_t;
+
+
+typedef struct {
+    int         sock;
+    char        name[8];
+    int         on;                     /* poofing?                     */
+
+    char        inbuf[2*BUFLEN];        /* partial message from server  */
+    int         inlen;
+
+    held_t      held[MAXQUEUE];         /* ring of messages in the air  */
+    int         held_head, held_tail;
+    long long   last_deliver;
+
+    timed_t     timed[MAXTIMED];        /* timed commands, unsorted     */
+    int         numTimed;
+    long long   last_timed;             /* server time of last one done */
+
+    long long   offset;                 /* server clock - our clock     */
+    long long   best_delay;             /* lowest round trip seen       */
+} effect_t;
+
+
+int         numEffects  = 12;
+int         jitter      = 0;            /* ms                           */
+int         seconds     = 20;
+int         doSync      = 0;
+char       *host        = "127.0.0.1";
+
+effect_t    effects[MAXEFFECTS];
+
+int         numActs     = 0;            /* poofs seen                   */
+long long   actAt[MAXACTS];             /* when they happened           */
+long long   actMeant[MAXACTS];          /* when they were meant to      */
+
+
+
+/*      OUR SUBROUTINES     */
+
+int         getSock();
+void        send_msg(int sock, char *msg);
+void        run(long long until);
+void        read_effect(effect_t *e, long long now);
+void        deliver(effect_t *e, held_t *h, long long now);
+void        do_cmd(effect_t *e, char *cmd, long long meant);
+void        poof(effect_t *e, int on, long long meant);
+void        report();
+int         cmp_ll(const void *a, const void *b);
+int         cmp_meant(const void *a, const void *b);
+long long   micros();
+
+
+
+
+/*      MAIN                */
+
+int main(int argc, char **argv) {
+
+    int     i, opt;
+    char    msg[BUFLEN];
+
+    while ((opt = getopt(argc, argv, "n:j:t:sh:")) != -1) {
+        switch (opt) {
+            case 'n': numEffects = atoi(optarg); break;
+            case 'j': jitter     = atoi(optarg); break;
+            case 't': seconds    = atoi(optarg); break;
+            case 's': doSync     = 1;            break;
+            case 'h': host       = optarg;       break;
+            default:
+                fprintf(stderr, "usage: %s [-n effects] [-j jitter_ms] [-t seconds] [-s] [-h host]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (numEffects < 1 || numEffects > MAXEFFECTS) numEffects = 12;
+
+    srand(time(NULL));
+
+    // the button, which wants to hear nothing back
+    int button = getSock();
+    send_msg(button, "B:*:DS:1");
+
+    // our effects
+    for (i=0; i<numEffects; i++) {
+        memset(&effects[i], 0, sizeof(effect_t));
+        effects[i].sock       = getSock();
+        effects[i].best_delay = -1;
+        sprintf(effects[i].name, "E%02d", i);
+        sprintf(msg, "%s:KA", effects[i].name);
+        send_msg(effects[i].sock, msg);
+    }
+    run(micros() + 200000LL);
+
+    // sync clocks, a few tries each, keeping the quickest
+    if (doSync) {
+        int x;
+        for (x=0; x<SYNC_TRIES; x++) {
+            for (i=0; i<numEffects; i++) {
+                sprintf(msg, "%s:*:TS:%lld", effects[i].name, micros());
+                send_msg(effects[i].sock, msg);
+            }
+            run(micros() + (jitter+20)*1000LL);
+        }
+        for (i=0; i<numEffects; i++)
+            if (effects[i].best_delay < 0)
+                printf("%s never synced!\n", effects[i].name);
+    }
+
+    // and a big round
+    send_msg(button, "B:2:1");
+    run(micros() + seconds*1000000LL);
+
+    report();
+
+    for (i=0; i<numEffects; i++) close(effects[i].sock);
+    close(button);
+
+    return 0;
+}
+
+
+
+
+/* SUBROUTINES  */
+
+
+/* get a socket connected to the server, without Nagle */
+int getSock() {
+
+    struct sockaddr_in servaddr;
+    int    flag = 1;
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port   = htons(PORT);
+    inet_pton(AF_INET, host, &(servaddr.sin_addr));
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+
+    return sockfd;
+}
+
+
+
+/* messages to the server are null terminated, same as the huzzahs do */
+void send_msg(int sock, char *msg) {
+    send(sock, msg, strlen(msg)+1, MSG_NOSIGNAL);
+}
+
+
+
+/*
+    read, deliver held messages, and carry out timed commands until 'until'.
+    wakes every 100us, which is plenty for a harness.
+*/
+void run(long long until) {
+
+    struct pollfd   fds[MAXEFFECTS];
+    struct timespec wait = { 0, 100000L };
+    long long       now;
+    int             i, t;
+
+    for (i=0; i<numEffects; i++) {
+        fds[i].fd     = effects[i].sock;
+        fds[i].events = POLLIN;
+    }
+
+    while ((now = micros()) < until) {
+
+        if (ppoll(fds, numEffects, &wait, NULL) > 0)
+            for (i=0; i<numEffects; i++)
+                if (fds[i].revents & POLLIN)
+                    read_effect(&effects[i], micros());
+
+        now = micros();
+
+        for (i=0; i<numEffects; i++) {
+
+            effect_t *e = &effects[i];
+
+            // messages whose (fake) wifi delay is up
+            while (e->held_head != e->held_tail && e->held[e->held_head].deliver_at <= now) {
+                deliver(e, &e->held[e->held_head], now);
+                e->held_head = (e->held_head + 1) % MAXQUEUE;
+            }
+
+            // timed commands whose time has come, oldest first
+            int found = 1;
+            while (found) {
+                found = -1;
+                for (t=0; t<e->numTimed; t++)
+                    if (e->timed[t].at <= now && (found < 0 || e->timed[t].at < e->timed[found].at))
+                        found = t;
+                if (found < 0) break;
+
+                timed_t done = e->timed[found];
+                e->timed[found] = e->timed[--e->numTimed];
+
+                if (done.server_at > e->last_timed) {
+                    e->last_timed = done.server_at;
+                    do_cmd(e, done.cmd, done.at);
+                }
+                found = 1;
+            }
+        }
+    }
+}
+
+
+
+/* read from the server, hold each (null terminated) message for a random bit */
+void read_effect(effect_t *e, long long now) {
+
+    int rc = read(e->sock, e->inbuf + e->inlen, sizeof(e->inbuf) - e->inlen - 1);
+    if (rc < 1) return;
+    e->inlen += rc;
+
+    int start = 0, i;
+    for (i=0; i<e->inlen; i++) {
+        if (e->inbuf[i] != '\0') continue;
+
+        int next = (e->held_tail + 1) % MAXQUEUE;
+        if (next != e->held_head) {
+            held_t *h = &e->held[e->held_tail];
+            long long at = now + (jitter ? (rand() % (jitter*1000)) : 0);
+
+            if (at < e->last_deliver) at = e->last_deliver;   // no passing on one connection
+            e->last_deliver = at;
+
+            h->raw_at     = now;
+            h->deliver_at = at;
+            snprintf(h->msg, sizeof(h->msg), "%s", e->inbuf + start);
+            e->held_tail = next;
+        }
+        start = i+1;
+    }
+
+    memmove(e->inbuf, e->inbuf + start, e->inlen - start);
+    e->inlen -= start;
+}
+
+
+
+/* the effect finally sees a message */
+void deliver(effect_t *e, held_t *h, long long now) {
+
+    char      *msg = h->msg;
+    long long  t0, t1, t2, at;
+    char       cmd[CMDLEN];
+
+    if (strncmp(msg, "$ts", 3) == 0) {
+
+        if (sscanf(msg+3, "%lld,%lld,%lld", &t0, &t1, &t2) == 3) {
+            long long delay = (now - t0) - (t2 - t1);
+            if (e->best_delay < 0 || delay < e->best_delay) {
+                e->best_delay = delay;
+                e->offset     = ((t1 - t0) + (t2 - now)) / 2;
+            }
+        }
+
+    } else if (strncmp(msg, "$@", 2) == 0) {
+
+        if (sscanf(msg+2, "%lld,%15[^%]", &at, cmd) == 2 && e->numTimed < MAXTIMED) {
+            timed_t *t   = &e->timed[e->numTimed++];
+            t->server_at = at;
+            t->at        = at - e->offset;
+            snprintf(t->cmd, CMDLEN, "%s", cmd);
+        }
+
+    } else if (msg[0] == '$') {
+
+        snprintf(cmd, CMDLEN, "%s", msg+1);
+        cmd[strcspn(cmd, "%")] = '\0';
+        do_cmd(e, cmd, h->raw_at);
+    }
+}
+
+
+
+/* carry out a command ("p1", "kill" ...) */
+void do_cmd(effect_t *e, char *cmd, long long meant) {
+
+    if (strcmp(cmd, "p1") == 0 || strcmp(cmd, "p2") == 0) {
+        poof(e, 1, meant);
+    } else if (strcmp(cmd, "p0") == 0) {
+        poof(e, 0, meant);
+    } else if (strcmp(cmd, "kill") == 0) {
+        e->numTimed = 0;
+        poof(e, 0, meant);
+    }
+}
+
+
+
+/* poof or stop, remembering when each poof started */
+void poof(effect_t *e, int on, long long meant) {
+
+    if (on && !e->on && numActs < MAXACTS) {
+        actAt[numActs]    = micros();
+        actMeant[numActs] = meant;
+        numActs++;
+    }
+    e->on = on;
+}
+
+
+
+/* lateness and interval error of every poof, in ms */
+void report() {
+
+    int        i;
+    int        order[MAXACTS];
+    long long  late[MAXACTS], err[MAXACTS];
+    double     sum = 0.0, sq = 0.0;
+
+    if (numActs < 2) {
+        printf("only %d poofs seen - is the server running, with nothing else on it?\n", numActs);
+        return;
+    }
+
+    // intervals are between poofs in the order they were meant to happen
+    for (i=0; i<numActs; i++) {
+        late[i]  = actAt[i] - actMeant[i];
+        order[i] = i;
+    }
+    qsort(order, numActs, sizeof(int), cmp_meant);
+
+    for (i=1; i<numActs; i++) {
+        int a = order[i-1], b = order[i];
+        err[i-1] = (actAt[b] - actAt[a]) - (actMeant[b] - actMeant[a]);
+        sum += err[i-1];
+        sq  += (double)err[i-1] * err[i-1];
+        if (err[i-1] < 0) err[i-1] = -err[i-1];
+    }
+
+    int    n    = numActs - 1;
+    double mean = sum / n;
+    double sd   = sqrt(sq / n - mean*mean);
+
+    qsort(late, numActs, sizeof(long long), cmp_ll);
+    qsort(err, n, sizeof(long long), cmp_ll);
+
+    printf("effects:%d  jitter:%dms  clock sync:%s  poofs:%d\n", numEffects, jitter, doSync ? "yes" : "no", numActs);
+    printf("lateness (ms)        p50:%7.3f  p99:%7.3f  max:%7.3f\n",
+           late[numActs/2]/1000.0, late[numActs*99/100]/1000.0, late[numActs-1]/1000.0);
+    printf("interval error (ms)  p50:%7.3f  p99:%7.3f  max:%7.3f  stddev:%7.3f\n",
+           err[n/2]/1000.0, err[n*99/100]/1000.0, err[n-1]/1000.0, sd/1000.0);
+}
+
+
+
+int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+
+
+int cmp_meant(const void *a, const void *b) {
+    return cmp_ll(&actMeant[*(const int *)a], &actMeant[*(const int *)b]);
+}
+
+
+
+/* microseconds on a monotonic clock */
+long long micros() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (long long)spec.tv_sec*1000000LL + spec.tv_nsec/1000;
+}
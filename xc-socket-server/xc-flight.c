@@ -0,0 +1,189 @@
+/*
+
+   xc-flight.c	V1.0
+   Copyright - Neil Verplank 2016, 2017, 2020 (c)
+   neil@capnnemosflamingcarnival.org
+
+
+	Reads xc-socket-server's flight recorder - the ring of the last
+	few thousand things the server did (accepts, closes, registrations,
+	reconnects, duplicates, dispatches, sends, schedules, idle closes,
+	resumes, upgrades), kept in a memory mapped file.  Works while the server runs, or
+	after it's crashed, since the file outlives it.
+
+	NOTE the record layout here has to match flight_hdr_t and
+	flight_rec_t in xc-socket-server.c.
+
+	To compile:
+
+	    gcc -o xc-flight xc-flight.c -Wall
+
+	and run (-n the last N records, -f to keep following, like tail):
+
+	    ./xc-flight [-n records] [-f] [file]
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define FLIGHT_FILE     "/var/tmp/xc-socket-server.flight"
+#define FLIGHT_MAGIC    "XCFLT001"
+#define FLIGHT_TEXT     40
+#define FOLLOW_EVERY    100000          /* us between looks, following */
+
+
+typedef struct _flight_hdr_t_ {
+    char             magic[8];
+    uint32_t         slots;
+    uint32_t         rec_size;
+    uint64_t         head;
+    char             pad[40];
+} flight_hdr_t;
+
+typedef struct _flight_rec_t_ {
+    uint64_t         seq;
+    int64_t          t_us;
+    uint16_t         type;
+    int16_t          fd;
+    int32_t          arg;
+    char             text[FLIGHT_TEXT];
+} flight_rec_t;
+
+char   *types[] = { "START", "ACCEPT", "CLOSE", "REGISTER", "RECONNECT", "DUPLICATE", "DISPATCH", "SEND", "SCHEDULE", "EVICT", "RESUME", "UPGRADE" };
+
+
+flight_hdr_t *flight;
+flight_rec_t *recs;
+
+
+
+/*      OUR SUBROUTINES     */
+
+uint64_t print_from(uint64_t from, uint64_t to);
+void     print_rec(flight_rec_t *rec);
+
+
+
+
+/*      MAIN                */
+
+int main(int argc, char **argv) {
+
+    char       *path   = FLIGHT_FILE;
+    long        last   = 50;
+    int         follow = 0;
+    int         opt;
+    struct stat st;
+
+    while ((opt = getopt(argc, argv, "n:f")) != -1) {
+        switch (opt) {
+            case 'n': last   = atol(optarg); break;
+            case 'f': follow = 1;            break;
+            default:
+                fprintf(stderr, "usage: %s [-n records] [-f] [file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) path = argv[optind];
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(flight_hdr_t)) {
+        perror(path);
+        return 1;
+    }
+
+    flight = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (flight == MAP_FAILED) { perror("mmap"); return 1; }
+    close(fd);
+
+    if (memcmp(flight->magic, FLIGHT_MAGIC, 8) != 0 || flight->rec_size != sizeof(flight_rec_t) ||
+        st.st_size < (off_t)(sizeof(flight_hdr_t) + (off_t)flight->slots*sizeof(flight_rec_t))) {
+        fprintf(stderr, "%s: not a flight recorder (or a different version)\n", path);
+        return 1;
+    }
+    recs = (flight_rec_t *)(flight + 1);
+
+    uint64_t head = __atomic_load_n(&flight->head, __ATOMIC_ACQUIRE);
+    uint64_t from = (head > (uint64_t)last) ? head - last : 0;
+
+    from = print_from(from, head);
+
+    while (follow) {
+        usleep(FOLLOW_EVERY);
+        head = __atomic_load_n(&flight->head, __ATOMIC_ACQUIRE);
+        if (head - from > flight->slots) {
+            printf("... %llu records lost\n", (unsigned long long)(head - from - flight->slots));
+            from = head - flight->slots;
+        }
+        from = print_from(from, head);
+    }
+
+    return 0;
+}
+
+
+
+
+/* SUBROUTINES  */
+
+
+/*
+    Print records from (inclusive) to to (exclusive), oldest first, and
+    return where we got to.  Each is copied out, and only printed if its
+    seq says it's the record we expected, and wasn't rewritten while we
+    copied it:  seq (acquire), the record, a fence, then seq again - the
+    server zeroes seq, fences, writes the record, then sets seq (release).
+*/
+uint64_t print_from(uint64_t from, uint64_t to) {
+
+    flight_rec_t rec;
+    uint64_t     n;
+
+    if (to - from > flight->slots) from = to - flight->slots;
+
+    for (n = from; n < to; n++) {
+
+        flight_rec_t *slot = &recs[n % flight->slots];
+        uint64_t      seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        memcpy(&rec, slot, sizeof(rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (seq != n+1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        print_rec(&rec);
+    }
+    fflush(stdout);
+
+    return to;
+}
+
+
+
+/* one record, one line */
+void print_rec(flight_rec_t *rec) {
+
+    char       when[32];
+    time_t     secs = rec->t_us / 1000000;
+    struct tm  tm;
+
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+    rec->text[FLIGHT_TEXT-1] = '\0';
+
+    printf("%s.%06ld  %-9s  fd:%-4d  %-6d  %s\n", when, (long)(rec->t_us % 1000000),
+           rec->type < sizeof(types)/sizeof(types[0]) ? types[rec->type] : "?",
+           rec->fd, rec->arg, rec->text);
+}
@@ -0,0 +1,112 @@
+/*
+
+   xc-plugin-sample.c	V1.0
+   Copyright - Neil Verplank 2016, 2017, 2020 (c)
+   neil@capnnemosflamingcarnival.org
+
+
+	A sample xc-socket-server plugin (see xc-plugin.h), one of each:
+
+	    effect:*:WV:A,B,C       a sequence - a wave, poofing A, then B,
+	                            then C, WAVE_POOF ms each, WAVE_GAP apart
+	    effect:*:PC             replies $pc<n>%, the number of messages
+	                            the output adapter has seen go out
+
+	To compile:
+
+	    gcc -shared -fPIC -o sample.so xc-plugin-sample.c -Wall
+
+	then mv it into the server's plugin directory (-P), and
+
+	    sudo kill -HUP $(pidof xc-socket-server)
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xc-plugin.h"
+
+
+#define WAVE_POOF       150             /* ms each effect poofs */
+#define WAVE_GAP        50              /* ms between them */
+#define WAVE_NAMES      256             /* longest list of names */
+
+
+int                 xc_plugin_abi = XC_PLUGIN_ABI;
+
+const xc_host_t    *host;
+long                sent;               /* messages out, since we were loaded */
+
+
+
+/*      OUR SUBROUTINES     */
+
+int     xc_plugin_init(const xc_host_t *h);
+void    xc_plugin_fini(void);
+void    wave(const xc_msg_t *msg);
+void    count(const xc_msg_t *msg);
+void    counter(const char *effect, const char *msg, int len);
+
+
+
+
+/* SUBROUTINES  */
+
+
+int xc_plugin_init(const xc_host_t *h) {
+
+    if (h->abi != XC_PLUGIN_ABI) return -1;
+    host = h;
+
+    if (host->register_verb("WV", wave) < 0 ||
+        host->register_verb("PC", count) < 0 ||
+        host->register_output(counter) < 0)
+        return -1;
+
+    host->log("sample loaded - WV, PC");
+    return 0;
+}
+
+
+
+void xc_plugin_fini(void) {
+    host->log("sample unloaded");
+}
+
+
+
+/* effect:*:WV:A,B,C - poof each in turn */
+void wave(const xc_msg_t *msg) {
+
+    char  names[WAVE_NAMES];
+    char *name, *save;
+    long  at = 0;
+
+    if (msg->third == NULL) return;
+
+    snprintf(names, sizeof(names), "%s", msg->third);
+
+    for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+        if (host->poof(name, at, WAVE_POOF) == 0)
+            at += WAVE_POOF + WAVE_GAP;
+}
+
+
+
+/* effect:*:PC - how many messages have gone out */
+void count(const xc_msg_t *msg) {
+
+    char reply[32];
+
+    snprintf(reply, sizeof(reply), "$pc%ld%%", sent);
+    host->send(msg->effect, reply);
+}
+
+
+
+/* output adapter - counts them */
+void counter(const char *effect, const char *msg, int len) {
+    sent++;
+}
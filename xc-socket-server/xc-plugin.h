@@ -0,0 +1,87 @@
+/*
+
+   xc-plugin.h	V1.0
+   Copyright - Neil Verplank 2016, 2017, 2020 (c)
+   neil@capnnemosflamingcarnival.org
+
+
+	The plugin interface for xc-socket-server.  A plugin is a shared
+	library, in the directory given with -P, that brings its own
+	message handlers, sequences and output adapters - so the effect
+	logic for a show can change without rebuilding the server, or
+	restarting it:  'kill -HUP' and every plugin is unloaded and the
+	directory loaded again, with every effect still connected.
+
+	A plugin exports
+
+	    int  xc_plugin_abi = XC_PLUGIN_ABI;
+	    int  xc_plugin_init(const xc_host_t *host);
+	    void xc_plugin_fini(void);              (optional)
+
+	and registers its handlers from xc_plugin_init() (return nonzero
+	not to be loaded).  Handlers are called straight from the server's
+	dispatch table, on its main loop - they must not block.  Anything
+	a plugin keeps (the host pointer included) is good until its
+	xc_plugin_fini().
+
+	NOTE this is the ABI.  Don't change what's here - add calls to the
+	end of xc_host_t, and bump XC_PLUGIN_ABI only when an old plugin
+	can't work with the new server.
+
+	To compile a plugin (see xc-plugin-sample.c):
+
+	    gcc -shared -fPIC -o sample.so xc-plugin-sample.c -Wall
+
+	and install it with mv (or cp to a new name, then mv) - never
+	copy over a plugin the server has loaded.
+
+*/
+
+#ifndef XC_PLUGIN_H
+#define XC_PLUGIN_H
+
+
+#define XC_PLUGIN_ABI     1
+
+
+/* a message from an effect, split at the colons - missing parts are NULL */
+typedef struct xc_msg {
+    const char      *effect;            // who sent it
+    const char      *first;             // "*" for control messages
+    const char      *second;            // the verb, for control messages
+    const char      *third;
+    const char      *fourth;
+    int              sock;              // the socket it came in on
+} xc_msg_t;
+
+
+/* message handler - for a control verb, or everything one effect sends */
+typedef void (*xc_handler_fn)(const xc_msg_t *msg);
+
+/* output adapter - sees each message as it's queued to an effect */
+typedef void (*xc_output_fn)(const char *effect, const char *msg, int len);
+
+
+/* what the server offers a plugin */
+typedef struct xc_host {
+    int              abi;               // XC_PLUGIN_ABI the server was built with
+    int              size;              // sizeof(xc_host_t), as the server has it
+
+    // registration - from xc_plugin_init() only.  0, or -1 if there's no room.
+    // a verb or effect registered again (even one of the server's) is taken over
+    int            (*register_verb)(const char *verb, xc_handler_fn fn);      // effect:*:<verb>...
+    int            (*register_effect)(const char *name, xc_handler_fn fn);    // name:...
+    int            (*register_output)(xc_output_fn fn);
+
+    // from a handler.  messages are whole, as sent - "$p1%"
+    int            (*send)(const char *effect, const char *msg);              // 0, or -1 if not online
+    void           (*send_all)(const char *msg);                              // all but the sender and DS
+    int            (*poof)(const char *effect, long begin_ms, long length_ms);// add to the sequence
+                                                                               // this message starts
+    // anywhere
+    void           (*log)(const char *text);                                  // when debugging
+    long long      (*micros)(void);                                           // the server's clock
+} xc_host_t;
+
+
+#endif
@@ -55,12 +55,108 @@
 
    Start the server on the command line:
 
-       ./xc-socket-server [1]
+       ./xc-socket-server [1] [-m port] [-c capture] [-r capture [-f]] [-F flight] [-R core] [-K port] [-P plugins] [-W rules]
    
    When the option 1 is added, DEBUG=1, and lots of useful info is dropped 
    into STDOUT.  When DEBUG is 0, the assumption is no output, and it will 
    run as a daemon. 
 
+   With -m, we also serve Prometheus metrics over HTTP on that port (e.g.
+   9061), for scraping by a monitoring stack.  See serve_metrics().
+
+   With -c file, everything that comes in (connects, reads, closes) is
+   also appended to a capture file.  Later,
+
+       ./xc-socket-server -r file [-f]
+
+   replays it through the same code, at real speed or (-f) as fast as
+   we can, and reports what came out.  See capture_frame() and replay().
+
+   Whatever the mode, the last FLIGHT_SLOTS things that happened (accepts,
+   closes, registrations, dispatches, sends...) are kept in a memory mapped
+   file, FLIGHT_FILE or -F file, for xc-flight.c to read - while we run, or
+   after a crash.  See flight_note().
+
+   With -R core (as root), we run real-time:  memory locked and pre-faulted,
+   SCHED_FIFO, pinned to that core (ideally one kept free with isolcpus=),
+   waking on traffic instead of polling.  See rt_setup().
+
+   An emergency stop runs in its own thread, whatever the main loop is
+   doing:  "XX" in a UDP packet to ESTOP_PORT (or -K port, 0 for none),
+   SIGUSR1, or the main loop going quiet for ESTOP_STALL_MS, and every
+   effect gets KILL_ALL.  See estop_thread().
+
+   An effect that goes quiet for IDLE_TIMEOUT seconds (-I secs, 0 for
+   never) - no keep-alive, nothing - is closed, and its collections move
+   on without it.  Its deadline sits on a timer wheel, so reads cost one
+   store and only the sockets actually due get looked at.  The kernel's
+   keepalive and TCP_USER_TIMEOUT catch the dead peers quicker still.
+   See wheel_tick().
+
+   An effect can ask for a resumption token (TK), and when it drops and
+   comes back - new socket, maybe a new ip - present it (RS) to pick up
+   where it left off:  name, DS, collections and any critical commands
+   still awaiting acks, all at once.  See resume_session().
+
+   The registry - effects, DS, acks, tokens, collections, round order - is
+   snapshotted to a memory mapped file, SNAP_FILE or -S file, once a second
+   if it changed, and restored at startup, before anyone connects.  So after
+   a crash or a restart, the first button press does what the last one did.
+   See snap_tick().
+
+   To upgrade without dropping anyone, start the new binary with -U while
+   the old one runs.  The old one hands over its listening socket, every
+   effect's socket and the registry (over UPGRADE_SOCK), and exits;  the
+   new one carries on with the same connections.  Not mid-sequence, or
+   with a stop unacked, though - the new one wouldn't know to finish them -
+   so until then the handover waits.  See upgrade_check().
+
+   With -P dir, every plugin (*.so) in dir is loaded at startup, and again
+   on SIGHUP - effects stay connected throughout.  Plugins register their
+   own control verbs, effect handlers (sequences included) and output
+   adapters, through the ABI in xc-plugin.h, and are called directly from
+   the dispatch table.  See plugins_load().
+
+   With -W file, the wiring - "when effect X sends M, send N to T, after
+   D ms" - comes from a rule file, reloaded on SIGHUP too.  Rules are
+   indexed by (effect, message), so however many there are, a message
+   costs one hash probe.  See rules_load() and rules_fire().
+
+   Continuous controls (sensors, knobs, the band-pass and drum inputs) can
+   send stream values, 'effect:~:<channel>:<value>', faster than the wifi
+   carries them.  Those aren't queued - each effect in the collection has
+   a slot per channel, overwritten by the next value until it goes out, and
+   they're held while the link is behind.  So the newest value arrives,
+   within a pass, and nothing piles up.  See stream_forward().
+
+   Effects can also say what they want to hear:  'effect:*:SU:<topic>',
+   topics like stage/north/flame/3, with * for any one level and # for
+   everything below.  Messages are published to a topic with
+   'effect:^:<topic>:<msg>', or by naming the topic in a collection (CC),
+   alongside effects.  Subscriptions live in a trie, and the subscribers
+   to each topic published are worked out once and kept, so a publish
+   costs what its subscribers do, not what every effect would.  See
+   publish().
+
+   Effects with several valves (the organ's twelve poofers) have
+   sub-channels, addressed 'ORGAN->3+4' (or 'ORGAN->1-12') wherever an
+   effect can be named - collections, the round order, rules.  They get
+   one message with a channel bitmask, $c<hex mask>,<cmd>%, and commands
+   for more channels in the same pass are merged into it, so twelve
+   valves change in one packet.  See chan_send().
+
+   We keep what we've told each effect (and each of its channels) - on,
+   off, or don't know - and a poof that wouldn't change anything isn't
+   sent:  the button held through a round, rounds that overlap.  Stops
+   always go.  'effect:*:LS' answers what's lit, from here, without
+   asking anyone.  See state_msg().
+
+   Broadcasts - the button to everyone, an effect to its collection -
+   don't walk lists of effects.  Effects are numbered, and who's online,
+   who's DS and who's in each collection are bitsets, so the recipients
+   are worked out 64 effects at a time and only they are visited.  See
+   send_ids().
+
    There are some (questionable) scripts in initscripts that can be linked
    into /etc/init.d and used to start xc-socket-server at boot, and optionally,
    but-client as well.  The latter presumes you'll have a physical button on
@@ -78,6 +174,9 @@
    This can be done at any time, whether other effects are present are not, 
    the collection is kept up to date with existing effects.
 
+   A collection can include topics (anything with a '/' in it) as well -
+   the message is published there too.  See publish().
+
    ***
 
    Any effect can block the receipt of messages (and be only a sender):
@@ -86,8 +185,12 @@
 
    ***
 
-   Look in subroutine processMsg() for how and where to 
-   insert any custom message handling code.
+   To add a message handler, write one like verb_cc() below and register
+   it in register_handlers():  register_verb() for a new 'effect:*:<verb>'
+   control message, register_effect() for everything a given effect sends
+   (as the button's are).  processMsg() finds it in a hash table - one
+   lookup, however many verbs there are.  Or, without a rebuild, put it
+   in a plugin - see xc-plugin.h.
 
    Default behavior right now when two identically named things try to get on
    the network is to ignore messages from all but the original.  This keeps both
@@ -103,14 +206,17 @@
 
    To compile:
 
-       gcc -o xc-socket-server xc-socket-server.c -lpthread -lrt -Wall
+       gcc -o xc-socket-server xc-socket-server.c -lpthread -lrt -ldl -Wall
 
 */
 
 
 
+#define _GNU_SOURCE                     // CPU_SET, sched_setaffinity
 #include <stdlib.h>		        // Standard Library
 #include <stdio.h>	        	// Basic I/O routines
+#include <stdarg.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <time.h>	        	// Time in microseconds
 #include <math.h>	        	// Math!
@@ -118,6 +224,7 @@
 #include <string.h>		
 #include <sys/types.h>	        	// standard system types
 #include <sys/stat.h>
+#include <sys/mman.h>                   // flight recorder
 #include <netinet/in.h>	        	// Internet address structures
 #include <arpa/inet.h>
 #include <sys/socket.h>	        	// socket interface functions
@@ -126,41 +233,194 @@
 #include <sys/time.h>	        	// for timeout values
 #include <signal.h>
 #include <netinet/tcp.h>        	// TCP_NODELAY
+#include <errno.h>
+#include <pthread.h>                    // background log writer
+#include <sched.h>                      // real-time mode
+#include <malloc.h>
+#include <poll.h>                       // emergency stop
+#include <sys/resource.h>
+#include <sys/un.h>                     // hot upgrade
+#include <sys/ioctl.h>                  // streams
+#include <linux/sockios.h>
+#include <dlfcn.h>                      // plugins
+#include <dirent.h>
+
+#include "xc-plugin.h"
 
 
 
 
 int	DEBUG           =  0;            // 0=daemon, no output, 1=command line with output 
+int     METRICS_PORT    =  0;            // port for prometheus metrics (-m), 0 for none
+char   *REPLAY          =  NULL;         // capture file to replay (-r), instead of listening
+int     REPLAY_FAST     =  0;            // replay as fast as we can (-f), not at real speed
+char   *FLIGHT          =  NULL;         // flight recorder file (-F), else FLIGHT_FILE
+int     RT              =  0;            // real-time mode (-R)
+int     RT_CORE         = -1;            // and the core it's pinned to
+int     ESTOP_UDP       = -1;            // emergency stop port (-K), 0 for none, else ESTOP_PORT
+int     IDLE_SECS       = -1;            // idle timeout (-I), 0 for none, else IDLE_TIMEOUT
+char   *SNAPSHOT        =  NULL;         // registry snapshot file (-S), else SNAP_FILE
+int     UPGRADE         =  0;            // take over from a running server (-U)
+int     LISTEN_Q        = -1;            // listen backlog (-B), else LISTEN_BACKLOG
+char   *PLUGINS         =  NULL;         // plugin directory (-P), none if not given
+char   *RULES           =  NULL;         // rule file (-W), none if not given
 
 #define	PORT               5061        	// port for our carnival server   	
 #define	BUFLEN	           1024        	// buffer length 	   	
 #define maxclients         40           // max number of newtwork clients, somewhat arbitrary	
 #define ROpoofLength       100         	// milliseconds of a poof in roundOrder 
 #define ROpoofDelay        40           // milliseconds delay between poofs roundOrder 	
+#define OUTBUFLEN          2048         // per-socket output gathered during one pass of the main loop
+#define STREAM_SLOTS       16           // stream channels pending per socket
+#define STREAM_LEN         48           // longest stream message out, $~<channel>,<value>%
+#define STREAM_BACKLOG     1024         // bytes unsent in the kernel, past which stream values wait
+#define TOPIC_LEN          128          // longest topic
+#define TOPIC_LEVELS       16           // most levels in one
+#define TOPIC_CACHE        256          // topics whose subscribers we keep worked out (power of 2)
+#define CHAN_MAX           32           // sub-channels an effect can have
+#define CHAN_CMD           16           // longest command sent to sub-channels
+#define SYNC_LEAD          250          // ms ahead of time a sequence is shipped to clock-synced effects
+#define MAXPENDING         256          // critical commands awaiting an ack (power of 2)
+#define ACK_TRIES          5            // sends of a critical command before we give up on it
+#define ACK_MIN_RTO        20000        // microseconds, least wait for an ack before resending
+#define ACK_MAX_RTO        500000       // microseconds, most wait for an ack before resending
+#define HDR_SUB_BITS       6            // latency histograms: 2^6 sub-buckets per power of 2 (~1.5%)
+#define HDR_BUCKETS        736          // ...covering 0 to 2^26 microseconds (about a minute)
+#define LAT_SLOTS          64           // messages per pass of the main loop we time sends for
+#define METRICS_PER_PASS   1            // metrics requests answered per pass of the main loop
+#define CAPTURE_BUF        (1<<20)      // stdio buffer for the capture file
+#define CAPTURE_MAGIC      "XCCAP001"   // start of a capture file
+#define REPLAY_DRAIN       500          // ms we let a replay run on after its last frame
+#define FLIGHT_FILE        "/var/tmp/xc-socket-server.flight"   // flight recorder, unless -F
+#define FLIGHT_MAGIC       "XCFLT001"   // start of a flight recorder file
+#define FLIGHT_SLOTS       8192         // records it keeps (64 bytes each)
+#define FLIGHT_TEXT        40           // bytes of name/message a record keeps
+#define LOG_SLOTS          4096         // log records waiting for the writer, at most
+#define LOG_ARGS           8            // arguments a log record keeps
+#define LOG_STRLEN         160          // bytes of string arguments a log record keeps
+#define LOG_IDLE_MS        1            // writer's nap when there's nothing to write
+#define LOOP_DELAY_US      1000         // nap at the end of each pass of the main loop
+#define LOOP_WAIT_MS       250          // longest the main loop waits for traffic (well under ESTOP_STALL_MS)
+#define RT_PRIORITY        50           // SCHED_FIFO priority in real-time mode (-R)
+#define RT_TICK_US         1000         // longest we wait for traffic in real-time mode
+#define RT_STACK_PREFAULT  (256*1024)   // stack we touch up front in real-time mode
+#define RT_HEAP_PREFAULT   (8*1024*1024)// heap we touch up front (and keep) in real-time mode
+#define ESTOP_PORT         5062         // UDP port for emergency stop, unless -K
+#define ESTOP_TICK_MS      10           // emergency stop looks at the heartbeat this often
+#define ESTOP_STALL_MS     2000         // main loop quiet this long, and we kill all (0 for never)
+#define ESTOP_PRIORITY     (RT_PRIORITY+10)  // SCHED_FIFO priority, if we're allowed it
+#define IDLE_TIMEOUT       630          // s without a word before an effect is dead (2 keep-alives, and some)
+#define WHEEL_TICK_MS      1000         // idle timer wheel's resolution
+#define WHEEL_SLOTS        1024         // and its slots (power of 2) - about 17 minutes around
+#define TCP_KEEPIDLE_S     60           // kernel keepalive probes after this much quiet...
+#define TCP_KEEPINTVL_S    10           // ...this far apart...
+#define TCP_KEEPCNT_N      3            // ...and this many unanswered, the connection's gone
+#define TCP_USER_TIMEOUT_MS 20000       // sent data unacked this long, the connection's gone
+#define RESUME_HOLD_MS     10000        // critical commands wait this long for a dropped effect to resume
+#define SNAP_FILE          "/var/tmp/xc-socket-server.registry"  // registry snapshot, unless -S
+#define SNAP_MAGIC         "XCREG001"   // start of a snapshot file
+#define SNAP_HALF          (256*1024)   // bytes for each of its two copies
+#define SNAP_EVERY_MS      1000         // how often we look for registry changes to save
+#define UPGRADE_SOCK       "/var/tmp/xc-socket-server.upgrade"  // unix socket a new binary takes over on
+#define UPGRADE_MAGIC      "XCUPG002"   // start of a hand over
+#define UPGRADE_MAGIC_1    "XCUPG001"   //   from an older server, that doesn't say it's going (see upgrade_send())
+#define UPGRADE_WAIT_MS    1000         // longest we wait on a new binary, all told (well under ESTOP_STALL_MS)
+#define UPGRADE_FDS        250          // sockets passed per message (the kernel takes 253)
+#define UPGRADE_HOLD_MS    30000        // longest a new binary waits on a running sequence, then it's refused
+#define LISTEN_BACKLOG     1024         // connections the kernel queues for us (also capped by somaxconn)
+#define ACCEPT_PER_PASS    256          // most we accept in one pass of the main loop
+#define TCP_FASTOPEN_QLEN  64           // TCP Fast Open requests pending, at most
+
+
+/*
+    Log levels.  Anything above LOG_LEVEL isn't compiled in at all, so
+    e.g. -DLOG_LEVEL=LV_INFO drops the per-message lines.  What is compiled
+    in still only shows with DEBUG (the 1 on the command line).
+*/
+#define LV_ERROR           0            // something failed
+#define LV_INFO            1            // connections, effects coming and going
+#define LV_DEBUG           2            // every message
+#ifndef LOG_LEVEL
+#define LOG_LEVEL          LV_DEBUG
+#endif
+
+#define LOG(level, ...)    do { if ((level) <= LOG_LEVEL && DEBUG) log_push(__VA_ARGS__); } while (0)
 
 
 // PRE-DEFINED OUTGOING MESSAGES  / MESSAGE STRUCTURE
 const char COLON[2]      = ":";          // primary internal messaging divider ("EFFECT[:msg1][:msg2][:msg3][:msg4]")
 const char COMMA[2]      = ",";          // secondary sub-divider (eg msg2 = "EFFECT1,EFFECT2..."
+const char ARROW[3]      = "->";         // an effect's sub-channels ("ORGAN->3+4", "ORGAN->1-12")
 
 #define PoofON            "$p1%"        // Poof All
 #define PoofOFF           "$p0%"        // Stop poofing
 #define PoofSTM           "$p2%"        // Poof Storm
 #define KILL_ALL          "$kill%"      // kill an effect
 
+/*
+    Clock-synced effects (see sync_clock()) also get:
+
+        $ts<t0>,<t1>,<t2>%      reply to a TS request: the effect's own send time,
+                                and our receive and send times, in microseconds
+        $@<time>,<cmd>%         timed command - do $<cmd>% at <time> microseconds
+                                on our clock.  Commands at or before the last one
+                                carried out are ignored; $kill% drops them all.
+
+    and effects that asked for acks (AK) get critical commands (PoofOFF, KILL_ALL, and
+    stops to sub-channels, $c<mask>,p0%) as:
+
+        $#<id>,<cmd>%           do $<cmd>%, and answer 'effect:*:OK:<id>'.  Resent
+                                with the same id until answered - do it once.
+
+    and session resumption (see resume_session()) answers with:
+
+        $tk<token>%             reply to TK: 16 hex digits to keep for an RS
+        $rs1% or $rs0%          reply to RS: resumed, or not (start over - CC, DS...)
+
+    and a stream value, from an effect in whose collection it is (see stream_forward()):
+
+        $~<channel>,<value>%    only ever the latest - values in between may be skipped
+
+    and to an effect with sub-channels (see chan_send()):
+
+        $c<mask>,<cmd>%         do $<cmd>% on the channels in mask (hex, bit n-1 for
+                                channel n) - $c3f,p1% poofs 1 to 6
+*/
+
 
 // VARIOUS INCOMING MESSAGES & KNOWN EFFECTS
 #define KeepAlive         "KA"
 #define CONTROL           "*"           // special control message
+#define STREAM            "~"           // stream value - effect:~:<channel>:<value>, last one wins
+#define PUBLISH           "^"           // publish - effect:^:<topic>:<msg>
 #define RO                "RO"          // ctl msg - set round order
 #define CC                "CC"          // ctl msg - set collection
 #define DS                "DS"          // ctl msg - set do_not_send flag
 #define XX                "XX"          // ctl msg - kill all poofers, kill events
+#define TS                "TS"          // ctl msg - clock sync request
+#define AK                "AK"          // ctl msg - set ack flag (acks for critical commands)
+#define OK                "OK"          // ctl msg - ack for a critical command
+#define LT                "LT"          // ctl msg - report latency percentiles (LT:0 also clears them)
+#define ST                "ST"          // ctl msg - report server stats
+#define TK                "TK"          // ctl msg - get a resumption token
+#define RS                "RS"          // ctl msg - resume, with that token (RS:<token>)
+#define SU                "SU"          // ctl msg - subscribe to topics (SU:a/b/*,c/#)
+#define UN                "UN"          // ctl msg - unsubscribe (UN:a/b/*), from all without topics
+#define SC                "SC"          // ctl msg - send a command (SC:ORGAN->1+2:p1), '*' for all
+#define LS                "LS"          // ctl msg - report what's lit (LS, or LS:<effect>)
 
 #define BUTTON            "B"
 #define BIGBETTY          "BIGBETTY"
 #define LULU              "LULU"
 
+#define HANDLER_SLOTS     256           // verbs (and effects) we can register handlers for, power of 2
+#define HANDLER_NAME      16            // longest verb or effect name a handler can have
+#define PLUGIN_MAX        32            // plugins loaded at once
+#define OUTPUT_MAX        16            // output adapters, from all plugins
+#define RULE_MAX          1024          // rules in a rule file
+#define RULE_SLOTS        2048          // rule index, power of 2 (and > RULE_MAX)
+#define RULE_TEXT         64            // longest field in a rule
+
 
 
 
@@ -174,6 +434,23 @@ typedef struct _list_t_ {
     char            *ipadd;             // ipadd this effect is on
     int              do_not_send;       // true if broadcast-only effect
     long             c_mod;             // last update of collection, or 0L 
+    int              synced;            // true if effect keeps our clock (TS), takes timed commands
+    int              shipped;           // (timed sequences) event already shipped ahead to this effect
+    int              acks;              // true if effect acks critical commands (AK)
+    long             srtt;              // smoothed round trip of acks, microseconds
+    long             rttvar;            // and its variation
+    int              loss;              // rolling loss estimate, per mille of critical sends
+    long             acked;             // critical commands acked
+    long             resent;            // critical commands resent (ack missing)
+    unsigned long long token;           // resumption token (TK), or 0 if never asked for
+    long long        resumed;           // micros() it last resumed (RS), or 0
+    int              topics;            // 1 if its collection has topics in it
+    uint32_t         chans;             // (on a list) only these sub-channels, bit n-1 for n - 0 for all of it
+    int              id;                // (in the table) its number, see eff_add() - else -1
+    uint64_t        *cset;              // bitset of the ids in its collection (those sent to by id)
+    int              cset_words;        //   its size
+    long             cset_gen;          //   and the eff_gen it was worked out for
+    int              cchans;            // 1 if its collection has sub-channels in it
     struct _list_t_ *next;              // next effect on a list, or in the hashtable bucket
     struct _list_t_ *collection;        // list of effects to whom I talk, if any
 } list_t;
@@ -218,6 +495,8 @@ typedef struct _msg_t_ {
     char   *fourthMsg;
     int     whosTalking;                // socket this effect is on
     char   *ipadd;                      // ip address this effect is on
+    uint32_t nameCode;                  // msg_code() of effectName, and
+    uint32_t verbCode;                  //   of secondMsg - for finding a handler
     struct _msg_t_ *next;               // next msg on the list, if any
 } msg_t;
 
@@ -239,20 +518,429 @@ typedef struct _event_t_ {
     long    begin;                      // relative time from 0 to begin
     long    length;                     // length of event in ms
     int     started;                    // 1 if begun
+    int     shipped;                    // 1 if shipped ahead to clock-synced effects
+    char   *msg;                        // "send" events - send msg
+    char   *target;                     //   to target (an effect, or "*")
+    int     from;                       //   (socket it came from, "*" skips it)
     struct _event_t_ *next;             // next event on a list
     struct _list_t_  *collection;       // list of effects ?
 } event_t;
 
 
 
+/*
+    Message handlers (see register_verb()).  Control verbs (effect:*:<verb>)
+    and effects with handlers of their own (the button) each have a table,
+    open addressed by the msg_code() of the verb or name - which new_msg()
+    has already worked out - so finding one doesn't depend on how many
+    there are.
+*/
+typedef event_t *(*handler_fn)(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable);
+
+typedef struct _handler_t_ {
+    uint32_t         code;              // msg_code(name), 0 if slot is free
+    char             name[HANDLER_NAME];
+    int              lat_class;         // what its messages are timed as (LAT_...)
+    handler_fn       fn;
+    xc_handler_fn    plugin;            // a plugin's handler, called in fn's place (see plugin_call())
+} handler_t;
+
+handler_t  verbs[HANDLER_SLOTS];        // control verbs
+handler_t  senders[HANDLER_SLOTS];      // effects, all of whose messages go to a handler
+
+void         *plugins[PLUGIN_MAX];      // dlopen()ed from PLUGINS
+int           num_plugins    = 0;
+int           plugin_loading = 0;       // 1 in xc_plugin_init() - registering's allowed
+xc_output_fn  outputs[OUTPUT_MAX];      // plugins' output adapters, called from queue_msg()
+int           num_outputs    = 0;
+int           in_output      = 0;       // 1 in an output adapter - no sending from there
+volatile sig_atomic_t reload_wanted = 0;    // SIGHUP - plugins and rules
+
+msg_t        *plugin_msg     = NULL;    // while a plugin's handler runs:  the message,
+fd_set       *plugin_sockets = NULL;    //   and what its calls to the host act on
+hash_table_t *plugin_table   = NULL;
+event_t      *plugin_seq     = NULL;    //   and the sequence it's building
+long          plugin_t0;                //   which starts now
+
+
+
+/*
+    Rules (see rules_load()):  when effect sends msg, send cmd to target,
+    after delay ms.  Rules for the same effect and msg are chained, in file
+    order, from their slot in index - open addressed by their codes.
+*/
+typedef struct _rule_t_ {
+    uint32_t         name_code;         // msg_code(effect)
+    uint32_t         msg_code;          // msg_code(msg)
+    char             effect[RULE_TEXT];
+    char             msg[RULE_TEXT];    // all after the effect's name - "2:1"
+    char             cmd[RULE_TEXT];
+    char             target[RULE_TEXT]; // an effect, or "*" for all but the sender
+    long             delay;             // ms, 0 for straight away
+    int              next;              // next rule with the same effect and msg, -1 for none
+} rule_t;
+
+typedef struct _rules_t_ {
+    int              count;
+    rule_t           rule[RULE_MAX];
+    int              index[RULE_SLOTS]; // first rule for an (effect, msg), -1 if free
+} rules_t;
+
+rules_t      *rules          = NULL;    // loaded from RULES
+
+
+
+/*
+    Topic subscriptions (see publish()) - a trie, one level of a topic per
+    node, each node's subscribers those to the pattern ending there.
+*/
+typedef struct _topic_t_ {
+    char              *level;           // "flame", or "*" (any one), or "#" (all below)
+    struct _topic_t_  *child;           // first level below
+    struct _topic_t_  *sibling;         // next on this level
+    list_t            *subs;            // effects subscribed (names only)
+} topic_t;
+
+/* the subscribers to a topic published, worked out once (see topic_subs()) */
+typedef struct _topic_hit_t_ {
+    uint32_t           code;            // msg_code(topic), 0 if empty
+    char              *topic;
+    long               gen;             // topic_gen when worked out
+    list_t            *subs;            // copies of the effects subscribed
+    long               c_mod;           // last brought up to date with the table
+} topic_hit_t;
+
+topic_t       topic_root;               // topics start with its children
+long          topic_gen      = 1;       // bumped with every (un)subscribe
+topic_hit_t   topic_cache[TOPIC_CACHE];
+
+
+
+/*
+    A critical command sent to an effect that acks, awaiting that ack.
+    Kept in pending[], at (id % MAXPENDING), so finding one is O(1) -
+    new ids skip slots that are still taken (see send_acked()).
+*/
+typedef struct _ack_t_ {
+    long             id;                // 0 if slot is free
+    list_t          *effect;            // effect (in the hash table) it went to
+    char             cmd[16];           // the command, e.g. "p0", or "c3f,p0"
+    long long        first_sent;        // microseconds
+    long long        last_sent;         // microseconds
+    long             rto;               // current wait before resending, microseconds
+    int              tries;             // sends so far
+} ack_t;
+
+
+
+
+/*
+    Per-socket state, indexed by socket number.  Output to a socket is
+    gathered here during a pass through the main loop and flushed once
+    at the end of the pass (see flush_output()), so a round event, a
+    collection forward and a button broadcast that coincide go out as
+    one TCP segment (and one wifi frame) rather than three.
+*/
+typedef struct _conn_t_ {
+    int     kind;                       // CONN_EFFECT, or one of the others below
+    int     out_len;                    // bytes waiting in out_buf
+    int     out_msgs;                   // messages waiting in out_buf
+    int     is_dirty;                   // 1 if on dirty[] below
+    unsigned long long lat_mask;        // which of this pass's lat[] messages are in out_buf
+    long    msgs_in;                    // messages read from this socket
+    long    msgs_out;                   // messages sent to it
+    long    bytes_out;                  // bytes sent to it
+    long    drops;                      // messages for it that didn't go out
+    long    last_seen;                  // millis() of its last read
+    int     wheel_slot;                 // idle wheel slot it's on, or -1
+    int     wheel_next, wheel_prev;     // neighbours there (fd+1, 0 for none)
+    list_t *effect;                     // effect registered on it, if any
+    char    ip[INET6_ADDRSTRLEN];       // peer's address
+    int     chan_at;                    // out_buf offset of the last sub-channel command,
+    int     chan_len;                   //   its length (0 if none, or it's no longer last),
+    uint32_t chan_mask;                 //   the channels it's for
+    char    chan_cmd[CHAN_CMD];         //   and what it tells them
+    uint32_t lit;                       // channels we last told to poof (bit n-1, all for $p1%),
+    uint32_t known;                     //   the channels we know that of,
+    long    lit_gen;                    //   as of which emergency stop (see state_check())
+    int     num_streams;                // stream values waiting, in streams[]
+    int     held;                       // bytes at the front of out_buf a stream-only send left behind
+    struct {
+        uint32_t code;                  //   msg_code() of the channel
+        int     plen;                   //   length of "$~<channel>,"
+        int     len;                    //   and of all of it, with the null
+        char    text[STREAM_LEN];
+    }       streams[STREAM_SLOTS];
+    long long resumed;                  // micros() a session resumed on it, until its first send
+    char   *resp;                       // (metrics) response being written, if any
+    int     resp_len;                   // its length
+    int     resp_off;                   // and how much is written
+    char    out_buf[OUTBUFLEN];         // pending output for this socket
+} conn_t;
+
+enum { CONN_EFFECT, CONN_METRICS_LISTEN, CONN_METRICS, CONN_UPGRADE_LISTEN };
+
+conn_t  conns[FD_SETSIZE];              // per-socket state
+int     dirty[FD_SETSIZE];              // sockets with pending output
+int     num_dirty      = 0;             // number of sockets on dirty[]
+int     wheel[WHEEL_SLOTS];             // idle wheel: first socket (fd+1) due in each tick's slot
+long    wheel_at       = 0;             // next tick the wheel looks at (millis()/WHEEL_TICK_MS)
+
+/*
+    Effects by number.  Each effect gets an id when it's first added to
+    the table, and as they're never taken out again the ids stay dense.
+    What a broadcast needs of an effect is kept in arrays by id - its
+    node, and bitsets of who's online and who's DS - so "everyone but the
+    sender", or "this collection, online, not DS, not the sender", is a
+    few and-nots a word (64 effects at a time), then a send to each bit
+    left.  See send_ids().
+*/
+list_t  **eff_node;                     // id -> its node in the hash table
+uint64_t *eff_online;                   // bit per id:  has a socket
+uint64_t *eff_ds;                       //   has DS set
+int       eff_count    = 0;             // ids handed out
+int       eff_cap      = 0;             // and room in the arrays for (a multiple of 64)
+long      eff_gen      = 0;             // bumped with each new id - collections' bitsets check it
+
+/*
+    Server stats, for 'effect:*:ST'.  Only ever written by the main loop,
+    so no locks - STAT_ADD() just makes sure anyone reading from elsewhere
+    sees whole values.  Rates are worked out once a second, in stats_tick().
+*/
+typedef struct _stats_t_ {
+    long    accepts;                    // connections accepted
+    long    conns;                      // connections open now
+    long    msgs_in;                    // messages read
+    long    bytes_in;                   // bytes read
+    long    msgs_out;                   // messages queued for sending
+    long    sends;                      // send() calls actually made (i.e. segments)
+    long    bytes_out;                  // bytes sent
+    long    drops;                      // messages that didn't go out (closed sockets, send errors)
+    long    dups;                       // messages ignored from duplicate effects
+    long    evictions;                  // sockets closed for going quiet
+    long    resumes;                    // sessions resumed with a token
+    long    coalesced;                  // stream values replaced by newer ones before they went
+    long    suppressed;                 // poofs not sent, the effect already poofing
+    long    sched_backlog;              // events waiting in the timed sequence
+    long    in_rate;                    // messages in, last second
+    long    out_rate;                   // messages out, last second
+    long    node_allocs, node_frees;    // memory - effect nodes
+    long    msg_allocs, msg_frees;      // messages
+    long    event_allocs, event_frees;  // events
+    long    scrapes;                    // metrics requests answered
+} stats_t;
+
+
+/*
+    Capture file (-c): CAPTURE_MAGIC, then one of these per frame, followed
+    by len bytes - the peer's ip for CAP_OPEN, what read() got for CAP_DATA.
+*/
+enum { CAP_OPEN, CAP_DATA, CAP_CLOSE };
+
+typedef struct _cap_rec_t_ {
+    long long        t_us;              // micros() when it came in
+    int              fd;                // socket it came in on
+    unsigned short   kind;              // CAP_OPEN, CAP_DATA, CAP_CLOSE
+    unsigned short   len;               // bytes following
+} cap_rec_t;
+
+/*
+    Flight recorder (see flight_note()): a header, then FLIGHT_SLOTS of
+    these in a ring.  xc-flight.c has the same layout - keep them in step.
+*/
+enum { FL_START, FL_ACCEPT, FL_CLOSE, FL_REGISTER, FL_RECONNECT, FL_DUPLICATE, FL_DISPATCH, FL_SEND, FL_SCHEDULE, FL_EVICT, FL_RESUME, FL_UPGRADE };
+
+typedef struct _flight_hdr_t_ {
+    char             magic[8];          // FLIGHT_MAGIC
+    uint32_t         slots;             // FLIGHT_SLOTS
+    uint32_t         rec_size;          // sizeof(flight_rec_t)
+    uint64_t         head;              // records ever written - the newest is head-1
+    char             pad[40];
+} flight_hdr_t;
+
+typedef struct _flight_rec_t_ {
+    uint64_t         seq;               // head when written, +1 (0 while being written)
+    int64_t          t_us;              // wall clock, microseconds
+    uint16_t         type;              // FL_ACCEPT...
+    int16_t          fd;                // socket
+    int32_t          arg;               // bytes, count, whatever suits the type
+    char             text[FLIGHT_TEXT]; // effect name, message, ip
+} flight_rec_t;
+
+/*
+    Registry snapshot (see snap_tick()):  this header, then two copies of
+    SNAP_HALF bytes.  The one not current is rewritten, then made current,
+    so a crash mid-write leaves the last snapshot whole.
+*/
+typedef struct _snap_hdr_t_ {
+    char             magic[8];          // SNAP_MAGIC
+    uint32_t         half;              // SNAP_HALF
+    uint32_t         current;           // copy holding the latest snapshot, 0 or 1
+    uint32_t         len[2];            // bytes used in each copy
+    uint64_t         seq;               // snapshots written
+    char             pad[32];
+} snap_hdr_t;
+
+/*
+    Hot upgrade (see upgrade_send()):  this, then the sockets - listener,
+    metrics listener and emergency stop port if any (UPG_METRICS, UPG_ESTOP
+    in flags), then effects - UPGRADE_FDS at a time, then
+    text_len bytes of registry.  The new binary answers '1' when it has
+    it all, and we answer '1' - we're going - and only then does it serve.
+*/
+typedef struct _upgrade_hdr_t_ {
+    char             magic[8];          // UPGRADE_MAGIC
+    int              nfds;              // sockets to follow
+    int              flags;             // UPG_METRICS, UPG_ESTOP - which sockets follow the listener
+    int              text_len;          // registry, as snap_build() has it, plus S lines
+} upgrade_hdr_t;
+
+enum { UPG_METRICS = 1, UPG_ESTOP = 2 };
+
+/*
+    Log records (see log_push()):  the format, and its arguments as they
+    were - strings copied in - for the writer thread to print later.
+*/
+typedef struct _log_rec_t_ {
+    long long        t_us;              // micros() when logged
+    const char      *fmt;               // printf format, always a literal
+    int              nargs;
+    char             kinds[LOG_ARGS];   // 'i'nt, 'l'ong, 'L'ong long, 'd'ouble, 'p'ointer, 's'tring
+    union {
+        long long    i;
+        double       d;
+        void        *p;
+        int          s;                 // offset in str
+    }                args[LOG_ARGS];
+    char             str[LOG_STRLEN];
+} log_rec_t;
+
+log_rec_t  log_ring[LOG_SLOTS];         // single producer (main loop), single consumer (writer)
+uint64_t   log_head;                    // records pushed
+uint64_t   log_tail;                    // records written
+long       log_dropped;                 // records we had no room for
+pthread_t  log_thread;
+int        log_running;
+
+
+flight_hdr_t *flight      = NULL;       // the mapped file, if we have one
+flight_rec_t *flight_recs = NULL;       // its ring
+long long     flight_epoch;             // wall clock at micros() == 0
+
+
+FILE      *capture_file = NULL;         // where we're capturing to, if anywhere
+long       capture_flushed;             // last time we flushed it (ms)
+
+FILE      *replay_file  = NULL;         // replaying from
+cap_rec_t  replay_rec;                  // next frame to replay
+char       replay_data[BUFLEN+1];       // and its bytes
+int        replay_have;                 // 1 if replay_rec is waiting to go
+long long  replay_t0;                   // capture time of the first frame
+long       replay_start;                // micros() when we started
+long       replay_done;                 // millis() when we ran out of frames
+int        replay_sock[FD_SETSIZE];     // captured fd -> our (server) end of a socketpair
+int        replay_peer[FD_SETSIZE];     // captured fd -> the client end, that we write to
+uint32_t   replay_hash[FD_SETSIZE];     // what came back on each, hashed (FNV-1a)
+uint32_t   replay_digest;               // and over all connections, once closed
+long       replay_frames, replay_bytes, replay_conns, replay_out;
+
+stats_t stats;
+long    last_tick      = 0L;            // millis() at last stats_tick()
+long    last_in        = 0L;            // stats.msgs_in at last tick
+long    last_out       = 0L;            // stats.msgs_out at last tick
+
+#define STAT_ADD(counter, n)    __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_SET(counter, n)    __atomic_store_n(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_GET(counter)       __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+
+/* a string that grows as we print onto it (see sb_printf()) */
+typedef struct _sb_t_ {
+    char            *data;
+    int              len;
+    int              size;
+} sb_t;
+
+snap_hdr_t   *snap        = NULL;       // the mapped snapshot file, if we have one
+sb_t          snap_sb     = { NULL, 0, 0 };  // the next snapshot, built here first
+long          snap_last   = 0L;         // millis() we last looked
+
+int           upgrade_sock   = -1;      // where a new binary asks us to hand over
+int           upgrade_wait   = -1;      // a new binary waiting for us to be idle
+long          upgrade_since  = 0L;      // millis() it started waiting
+int           metrics_listen = -1;      // metrics listener, if any
+int           opts_inherited = -1;      // accepted sockets get the listener's options (-1 don't know yet)
+
 
 int     max_socket     = 0;             // will hold the largest possible next socket number
 int     firstSocket    = 0;             // socket to which we listen
-long    start_time     = 0;             // sys clock when we begin
-long    start_ms       = 0;             // sys clock when we begin
-long    current_time   = 0;             // millisenconds since start_time
+long long start_us     = 0;             // monotonic clock when we begin, in microseconds
+
+/*
+    Latency histograms (HDR style - log-linear buckets, fixed memory,
+    O(1) to record) for each class of message:
+
+        read>dispatch   read() returned, to handling the message (for
+                        scheduled events: when due, to when handled)
+        dispatch>first  handling the message, to the first send() it caused
+        dispatch>last   handling the message, to the last send() it caused
+*/
+typedef struct _hdr_t_ {
+    long             count;             // values recorded
+    long             max;               // largest value recorded
+    long long        sum;               // of all values recorded
+    long             buckets[HDR_BUCKETS];
+} hdr_t;
+
+enum { LAT_BUTTON, LAT_CONTROL, LAT_KILL, LAT_COLLECTION, LAT_SCHEDULED, LAT_RULE, LAT_STREAM, LAT_CLASSES };
+enum { LAT_READ, LAT_FIRST, LAT_LAST, LAT_METRICS };
+
+const char *lat_class[LAT_CLASSES]   = { "button", "control", "kill", "collection", "scheduled", "rule", "stream" };
+const char *lat_metric[LAT_METRICS]  = { "read>dispatch", "dispatch>first", "dispatch>last" };
+
+hdr_t   latency[LAT_CLASSES][LAT_METRICS];
+hdr_t   rt_late;                        // (real-time) how late we woke, past RT_TICK_US
+hdr_t   estop_lat;                      // emergency stop, trigger to last KILL_ALL sent
+hdr_t   resume_lat;                     // resumed session, RS read to first send
+
+
+/*
+    Emergency stop (see estop_thread()).  estop_fd[] is the thread's own
+    dup of each armed effect socket, +1 (0 = not armed) - the main loop
+    fills it in, and hands dups it no longer wants back through
+    estop_release[] for the thread to close, so it never closes one the
+    thread might be sending on.
+*/
+int        estop_on;                    // thread's running
+int        estop_udp = -1;              // its UDP socket, once it has one (bound, or handed over)
+pthread_t  estop_tid;
+int        estop_fd[FD_SETSIZE];        // socket -> our dup of it, +1
+int        estop_release[FD_SETSIZE];   // dups to close, single producer (main), single consumer (thread)
+uint64_t   estop_rel_head, estop_rel_tail;
+int        estop_pipe[2];               // SIGUSR1 -> thread
+long long  estop_sig_us;                // when the signal came
+long long  heartbeat;                   // main loop's last pass, micros()
+long       estop_gen;                   // emergency stops so far (the state table forgets at each)
+
+/* messages handled in this pass of the main loop, awaiting their sends */
+typedef struct _lat_t_ {
+    int              class;             // LAT_BUTTON ...
+    long long        dispatched;        // microseconds
+    long long        first;             // first send, or 0
+    long long        last;              // last send
+} lat_t;
+
+lat_t   lat[LAT_SLOTS];
+int     num_lat        = 0;             // entries in lat[] this pass
+int     lat_cur        = -1;            // entry for the message being handled, or -1
+long long last_read    = 0;             // when the last read() returned
+
+
+ack_t   pending[MAXPENDING];            // critical commands awaiting acks
+int     num_pending    = 0;             // how many
+long    last_ack_id    = 0L;            // last id handed out
+long    current_time   = 0;             // millisenconds since start_us
 
-long    last_now       = 0L;
 
 
 
@@ -263,9 +951,51 @@ void            checkDebug();
 void            forkify();
 void            getFirstSock();
 int             acceptSK();
+int             sock_options();
+int             listen_options();
+void            getip();
+void            add_socket();
 void            forceCloseSK();
 void            closeSK();
 int             namedSock();
+int             resume_session();
+void            issue_token();
+
+// idle connections
+void            wheel_add();
+void            wheel_remove();
+void            wheel_tick();
+
+// streams
+void            stream_forward();
+void            stream_put();
+int             stream_room();
+
+// sub-channels
+void            send_to();
+void            chan_send();
+int             chan_parse();
+char           *chan_name();
+void            chan_format();
+
+// effect state
+int             state_msg();
+int             state_of();
+uint32_t        state_need();
+void            state_set();
+void            state_check();
+void            report_lit();
+
+// topics
+void            subscribe();
+void            unsubscribe();
+int             topic_split();
+void            topic_add();
+int             topic_remove();
+void            topic_match();
+topic_hit_t    *topic_subs();
+void            publish();
+void            topic_snap();
 
 // messaging routines
 msg_t          *new_msg();
@@ -273,8 +1003,137 @@ char           *copy_str_part();
 event_t        *readBuffer();
 event_t        *processMsg();
 void            send_msg ();
+void            queue_msg();
+void            flush_sock();
+void            flush_output();
 void            send_all();
 event_t        *doControl();
+void            sync_clock();
+void            send_timed();
+
+// message handlers
+uint32_t        msg_code();
+int             register_verb();
+int             register_effect();
+int             register_handler();
+handler_t      *find_handler();
+void            register_handlers();
+event_t        *verb_xx();
+event_t        *verb_ro();
+event_t        *verb_cc();
+event_t        *verb_ds();
+event_t        *verb_ts();
+event_t        *verb_ok();
+event_t        *verb_ak();
+event_t        *verb_lt();
+event_t        *verb_st();
+event_t        *verb_tk();
+event_t        *verb_rs();
+event_t        *verb_su();
+event_t        *verb_un();
+event_t        *verb_sc();
+event_t        *verb_ls();
+
+// plugins
+void            plugins_load();
+void            plugins_unload();
+int             plugin_file();
+void            plugin_open();
+void            reload_signal();
+event_t        *plugin_call();
+int             host_register_verb();
+int             host_register_effect();
+int             host_register_output();
+int             host_send();
+void            host_send_all();
+int             host_poof();
+void            host_log();
+long long       host_micros();
+
+// rules
+void            rules_load();
+int             rule_add();
+int             rule_find();
+event_t        *rules_fire();
+void            rule_send();
+
+// latency
+void            hdr_record();
+long            hdr_top();
+long            hdr_percentile();
+void            lat_begin();
+void            lat_end();
+void            lat_sent();
+void            lat_record();
+void            report_latency();
+void            reply_msg();
+
+// stats
+void            stats_tick();
+void            report_stats();
+
+// emergency stop
+void            estop_start();
+int             estop_bind();
+void            estop_set();
+void           *estop_thread();
+void            estop_fire();
+void            estop_signal();
+
+// real-time mode
+void            rt_setup();
+void            rt_prefault_stack();
+
+// logging
+void            log_start();
+void            log_push(const char *fmt, ...);
+void           *log_writer();
+int             log_drain();
+void            log_format();
+void            log_flush();
+
+// flight recorder
+int             private_open();
+void            flight_open();
+void            flight_note();
+
+// registry snapshot
+void            snap_open();
+void            snap_restore();
+void            snap_tick();
+void            snap_build();
+int             snap_load();
+
+// hot upgrade
+void            upgrade_listen();
+void            upgrade_check();
+int             upgrade_send();
+int             upgrade_timeout();
+int             upgrade_receive();
+int             upgrade_pass_fds();
+int             upgrade_take_fds();
+int             upgrade_write();
+int             upgrade_read();
+
+// capture and replay
+void            capture_open();
+void            capture_frame();
+void            replay_open();
+int             replay();
+void            replay_drain();
+void            replay_close();
+void            replay_report();
+
+// prometheus metrics
+void            getMetricsSock();
+void            serve_metrics();
+char           *build_metrics();
+
+// acks for critical commands
+int             is_critical();
+void            send_acked();
+void            got_ack();
+void            check_acks();
 
 // buttons and poofing
 event_t        *doButton();
@@ -288,13 +1147,15 @@ void            bigbetty_poof();
 // events
 event_t        *new_event();
 event_t        *check_events();
+void            ship_event();
 event_t        *concat_events();
 
 // utilities
 void            error();
-void            cur_time();
 long            millis();
+long long       micros();
 int             naive_str2int ();
+void            sb_printf(sb_t *sb, const char *fmt, ...);
 char            *int2str ();
 void            delay();
 void            delay_micro();
@@ -302,6 +1163,10 @@ void            delay_micro();
 // lists and collections
 void            set_collection();
 void            send_to_collection();
+int             collection_ids();
+void            send_ids();
+int             eff_add();
+void            eff_sync();
 void            update_collection();
 void            sendto_msg_list();
 void            set_list_order();
@@ -326,6 +1191,7 @@ int             get_socket();
 int             set_effect_socket();
 int             set_effect_socket_sk();
 void            set_effect_ds();
+void            set_effect_acks();
 int             hash_table_count();
 
 // freeing memory
@@ -368,12 +1234,10 @@ int main(int argc,char **argv) {
     fd_set	   open_sockets;   		// set of open sockets
     fd_set	   readable_sockets; 		// set of sockets available to be read
     fd_set	   writeable_sockets; 		// set of sockets available for writing 
-    char           *ipadd;
 
     hash_table_t   *my_hash_table;		// hash for holding effect names, sockets, properties
     event_t        *my_events  = NULL;		// struct for holding the current timed sequence
     event_t        *new_events = NULL;		// new timed sequences
-    long           seq_start   = 0L;            // start time for timed sequence
 
     int            size_of_table 
                      = (int)maxclients/2;       // theorectically, a max of 2 per bucket, ideal.
@@ -386,46 +1250,121 @@ int main(int argc,char **argv) {
     millis(); 
     FD_ZERO(&open_sockets);	
 
+    // (after the fork - the writer is a thread)
+    if (DEBUG)
+        log_start();
+
+    // emergency stop has its own thread, and priority
+    if (!REPLAY)
+        estop_start();
+
+    // and after the threads have started, so they aren't pinned with us
+    if (RT)
+        rt_setup();
+
     // Create basic hash table to use as associative array for named sockets
     my_hash_table = create_hash_table(size_of_table);
 
-    // get and bind first socket for listening
-    getFirstSock(&open_sockets);
+    // and the handlers for each kind of message - ours, then the plugins' - and the rules
+    register_handlers();
+    if (PLUGINS) plugins_load(PLUGINS);
+    if (RULES)   rules_load(RULES);
+    if (PLUGINS || RULES) signal(SIGHUP, reload_signal);
+
+    // get and bind first socket for listening - unless we're replaying a capture,
+    // or taking over (sockets, registry and all) from the server we replace.
+    // otherwise, fill the table from the last snapshot, before anyone connects
+    if (REPLAY)
+        replay_open(REPLAY);
+    else if (!UPGRADE || !upgrade_receive(&open_sockets, my_hash_table)) {
+        snap_restore(my_hash_table);
+        getFirstSock(&open_sockets);
+    }
+
+    // and one for metrics, if wanted
+    if (METRICS_PORT && metrics_listen < 0)
+        getMetricsSock(&open_sockets);
+
+    // and be ready to hand over to the next version of us
+    if (!REPLAY)
+        upgrade_listen(&open_sockets);
    
     // continuously await then process messages
     while (1) {
 
+        __atomic_store_n(&heartbeat, micros(), __ATOMIC_RELAXED);
+
 	readable_sockets   = open_sockets;
 	writeable_sockets  = open_sockets;
 
 	// check which sockets are ready for reading.     
-        // (null in timeout means wait until incoming data)
-        select(max_socket+1, &readable_sockets, &writeable_sockets, NULL, (struct timeval *)NULL);
+        // (wait for incoming data - but not so long the heartbeat stops and the emergency
+        // stop takes a quiet show for a stalled one.  a replay has frames to play, so doesn't)
+        struct timeval no_wait = { 0, 0 };
+        struct timeval idle    = { LOOP_WAIT_MS / 1000, (LOOP_WAIT_MS % 1000) * 1000 };
+        if (RT) {
+            // real-time: sleep until there's traffic, or the next tick for events and acks.
+            // sends don't block for long, so everything is taken as writeable
+            struct timeval tick = { 0, RT_TICK_US };
+            long long asleep    = micros();
+            if (select(max_socket+1, &readable_sockets, NULL, NULL, &tick) == 0)
+                hdr_record(&rt_late, micros() - asleep - RT_TICK_US);
+        } else
+            select(max_socket+1, &readable_sockets, &writeable_sockets, NULL, REPLAY ? &no_wait : &idle);
 
         // return from select - add incoming sockets to pool 
-        ipadd = "";
-        acceptSK(firstSocket, readable_sockets, &open_sockets, &ipadd);
+        if (REPLAY) {
+            if (!replay(&open_sockets, my_events)) break;
+        } else
+            acceptSK(firstSocket, readable_sockets, &open_sockets);
 
         // go through sockets and read buffer from any readable sockets (and internally process messages)
 	for (i=firstSocket+1; i<max_socket+1; i++)  {
 
             // read incoming, set named effect, get socket number
+            new_events = NULL;
+            if (conns[i].kind != CONN_EFFECT) continue;
             if (FD_ISSET(i, &readable_sockets)) 
-                new_events = readBuffer(i, &readable_sockets, &open_sockets, &writeable_sockets, ipadd, my_hash_table);
-            if (new_events) {
+                new_events = readBuffer(i, &readable_sockets, &open_sockets, &writeable_sockets, conns[i].ip, my_hash_table);
+            if (new_events) 
                 my_events = concat_events(my_events,new_events);
-// kind of presumes there wasn't already a seq_start?
-                seq_start = millis();
-            }
 
         }
 
-        // take care of any timed events
-        my_events = check_events(my_events, seq_start, &open_sockets, my_hash_table); 
+        // take care of any timed events, and resend critical commands not acked
+        my_events = check_events(my_events, &open_sockets, my_hash_table); 
+        check_acks(&open_sockets, my_hash_table);
+        wheel_tick(&open_sockets, my_hash_table);
+
+        // and send everything gathered on this pass, one send per socket
+        flush_output(&open_sockets, my_hash_table);
+
+        stats_tick();
+        snap_tick(my_hash_table);
+
+        // SIGHUP - reload plugins and rules, between passes (no handler's running)
+        if (reload_wanted) {
+            reload_wanted = 0;
+            if (PLUGINS) plugins_load(PLUGINS);
+            if (RULES)   rules_load(RULES);
+        }
+
+        // a new binary taking over?  (after the flush - nothing's left queued)
+        upgrade_check(&readable_sockets, &open_sockets, my_hash_table, my_events);
+
+        // metrics last - no scrape should delay an effect
+        if (METRICS_PORT)
+            serve_metrics(&readable_sockets, &writeable_sockets, &open_sockets, my_hash_table);
 
-        delay_micro(1); // even this makes a huge difference in not monopolizing system resources.
+        if (!RT && (!REPLAY_FAST || !replay_have))
+            delay_micro(LOOP_DELAY_US); // even this makes a huge difference in not monopolizing system resources.
     } 
 
+    log_flush();
+
+    if (REPLAY)
+        replay_report();
+
     free_event_list(my_events);
     free_table(my_hash_table);
 
@@ -450,10 +1389,45 @@ int main(int argc,char **argv) {
 /*      DAEMON SUBROUTINES     */
 
 
-/* check if DEBUG from command line */
+/* check if DEBUG from command line, and any options */
 void checkDebug(int argc, char **argv) {
-    if (argc == 2) {
-        DEBUG = (int)argv[1][0]-'0';
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:c:r:fF:R:K:I:S:UB:P:W:")) != -1) {
+        switch (opt) {
+            case 'm': METRICS_PORT = atoi(optarg); break;
+            case 'c': capture_open(optarg);        break;  // now, before a daemon changes directory
+            case 'r': REPLAY       = optarg;       break;
+            case 'f': REPLAY_FAST  = 1;            break;
+            case 'F': FLIGHT       = optarg;       break;
+            case 'R': RT           = 1;
+                      RT_CORE      = atoi(optarg); break;
+            case 'K': ESTOP_UDP    = atoi(optarg); break;
+            case 'I': IDLE_SECS    = atoi(optarg); break;
+            case 'S': SNAPSHOT     = optarg;       break;
+            case 'U': UPGRADE      = 1;            break;
+            case 'B': LISTEN_Q     = atoi(optarg); break;
+            case 'P': PLUGINS      = optarg;       break;
+            case 'W': RULES        = optarg;       break;
+            default:
+                fprintf(stderr, "usage: %s [1] [-m metrics_port] [-c capture] [-r capture [-f]] [-F flight] [-R core] [-K port] [-I idle_secs] [-S snapshot] [-U] [-B backlog] [-P plugins] [-W rules]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    // always on - but not for replays, which would overwrite the show's history
+    // (or start from some other show's registry)
+    if (!REPLAY) {
+        flight_open(FLIGHT ? FLIGHT : FLIGHT_FILE);
+        snap_open(SNAPSHOT ? SNAPSHOT : SNAP_FILE);
+    }
+
+    if (IDLE_SECS < 0) IDLE_SECS = IDLE_TIMEOUT;
+    if (LISTEN_Q  < 1) LISTEN_Q  = LISTEN_BACKLOG;
+
+    if (optind < argc) {
+        DEBUG = (int)argv[optind][0]-'0';
     }
 }
 
@@ -479,7 +1453,7 @@ void forkify(int argc, char **argv) {
 
     checkDebug(argc, argv);
 
-    if (!DEBUG) {
+    if (!DEBUG && !REPLAY) {      // a replay reports when it's done, so stays put
 
         pid_t process_id = 0;
         pid_t sid = 0;
@@ -504,7 +1478,7 @@ void forkify(int argc, char **argv) {
       
         chdir("/");		// Change the current working directory to root.
 
-    } else {
+    } else if (DEBUG) {
         printf("open for debugging!\n");fflush(stdout);
     } 
 
@@ -534,6 +1508,10 @@ void getFirstSock(fd_set *open_sockets) {
 	error("socket: allocation failed");
     }
 
+    // don't let the last run's connections, sitting in TIME_WAIT, keep us from binding
+    int flag = 1;
+    setsockopt(firstSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(int));
+
     // bind the socket to the newly formed address 
     int rc = bind(firstSocket, (struct sockaddr *)&sa, sizeof(sa));
 
@@ -544,10 +1522,10 @@ void getFirstSock(fd_set *open_sockets) {
 
     /* ask the system to listen for incoming connections	*/
     /* to the address we just bound. specify that up to		*/
-    /* 5 pending connection requests will be queued by the	*/
-    /* system, if we are not directly awaiting them using	*/
+    /* LISTEN_Q pending connection requests will be queued by	*/
+    /* the system, if we are not directly awaiting them using	*/
     /* the accept() system call, when they arrive.		*/
-    rc = listen(firstSocket, 5);
+    rc = listen_options(firstSocket);
 
     /* check there was no error */
     if (rc) {
@@ -562,79 +1540,160 @@ void getFirstSock(fd_set *open_sockets) {
 
 
 
-/* Accept an incoming socket */
-int acceptSK(int s, fd_set readable_sockets, fd_set *open_sockets, char **ipout ) {
-
-    /* accept incoming connections, if any, add to array */
- 
-    int  cs     = 0;
-    int  result = 0;
-    int  flag   = 1;	  	 	/* for TCP_NODELAY				*/
+/*
+    Accept incoming sockets - everything waiting, up to ACCEPT_PER_PASS, so
+    when the access point comes back and every effect reconnects at once,
+    they're all in within a pass or two.  The listener is non-blocking, so
+    we stop when it's empty.  Options (no Nagle, keepalive) come with the
+    socket from the listener, where Linux does that - see sock_options().
+*/
+int acceptSK(int s, fd_set readable_sockets, fd_set *open_sockets) {
 
-    struct sockaddr_storage	csa; 	/* client's address struct 			*/
-    char ipstr[INET6_ADDRSTRLEN];
-    socklen_t size_csa; 		/* size of client's address struct 		*/
-    size_csa = sizeof(csa);		/* remember size for later usage */
+    int                     cs, n = 0;
+    struct sockaddr_storage csa;        /* client's address struct */
+    socklen_t               size_csa;
+    conn_t                 *conn;
 
-    /* if the 's' socket is ready for reading, it	*/
-    /* means that a new connection request arrived.	*/
+    if (!FD_ISSET(s, &readable_sockets)) return 0;
 
-    if (FD_ISSET(s, &readable_sockets)) {
+    while (n < ACCEPT_PER_PASS) {
 
-        // accept the incoming connection 
-        cs = accept(s, (struct sockaddr *)&csa, &size_csa);
+        size_csa = sizeof(csa);
+        cs = accept4(s, (struct sockaddr *)&csa, &size_csa, SOCK_CLOEXEC);
 
-        // check for errors. if any, ignore new connection 
-       	if (cs < 0) {
-       	    return 0;
+        // none left (or an error - ignore that connection, as ever)
+        if (cs < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
         }
+        n++;
 
-        // Turn off Nagle's algorithm for less delay 
-        result = setsockopt(
-	      cs,
-              IPPROTO_TCP,    
-              TCP_NODELAY,   
-              (char *) &flag,
-              sizeof(int));
+        // select() can't watch it - turn it away rather than overrun the fd_sets
+        if (cs >= FD_SETSIZE) {
+            LOG(LV_ERROR, "xx  REFUSED socket#:%d, past FD_SETSIZE\n", cs);
+            close(cs);
+            continue;
+        }
 
-        if (result < 0) {
+        // first one - see if the listener's options came with it
+        if (opts_inherited < 0) {
+            int       v = 0;
+            socklen_t l = sizeof(v);
+            opts_inherited = (getsockopt(cs, IPPROTO_TCP, TCP_NODELAY, &v, &l) == 0 && v);
+        }
+        if (!opts_inherited && sock_options(cs) < 0) {
             // note, error doesn't preclude continuing 
-            if (DEBUG) { printf("TCP_NODEAY failed.\n");fflush(stdout); }
+            LOG(LV_ERROR, "socket options failed.\n");
         }
 
-        FD_SET(cs, open_sockets);		        /* add socket to set of open sockets */
-        if (cs > max_socket) { max_socket = cs; }  	/* reset max */
-	  
+        add_socket(cs, open_sockets);
 
+        conn = &conns[cs];
         if (csa.ss_family == AF_INET) {
             struct sockaddr_in *ss = (struct sockaddr_in *)&csa;
-            inet_ntop(AF_INET, &ss->sin_addr, ipstr, sizeof ipstr);
+            inet_ntop(AF_INET, &ss->sin_addr, conn->ip, sizeof(conn->ip));
         } else if (csa.ss_family == AF_INET6) {
             struct sockaddr_in6 *ss = (struct sockaddr_in6 *)&csa;
-            inet_ntop(AF_INET6, &ss->sin6_addr, ipstr, sizeof ipstr);
+            inet_ntop(AF_INET6, &ss->sin6_addr, conn->ip, sizeof(conn->ip));
         } 
 
-        if (DEBUG) { cur_time(); printf("->->new socket#:%02d ipaddr:%s\n", cs, ipstr);fflush(stdout); }
-
-        *ipout = strdup(ipstr);
+        LOG(LV_INFO, "->->new socket#:%02d ipaddr:%s\n", cs, conn->ip);
+        flight_note(FL_ACCEPT, cs, 0, conn->ip);
+        if (capture_file) capture_frame(CAP_OPEN, cs, conn->ip, strlen(conn->ip));
     }
 
-    return cs;
+    return n;
+}
+
+
+
+/*
+    No Nagle, for less delay, and have the kernel notice a peer that's gone
+    (power cut, out of wifi range) long before the idle wheel would.  Set on
+    the listener, accepted sockets inherit them (on Linux);  acceptSK()
+    checks, and sets them on each socket if they don't.
+*/
+int sock_options(int s) {
+
+    int flag = 1, idle = TCP_KEEPIDLE_S, intvl = TCP_KEEPINTVL_S, cnt = TCP_KEEPCNT_N, user = TCP_USER_TIMEOUT_MS;
+
+    if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY,      &flag,  sizeof(int)) < 0 ||
+        setsockopt(s, SOL_SOCKET,  SO_KEEPALIVE,     &flag,  sizeof(int)) < 0 ||
+        setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE,     &idle,  sizeof(int)) < 0 ||
+        setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL,    &intvl, sizeof(int)) < 0 ||
+        setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT,      &cnt,   sizeof(int)) < 0 ||
+        setsockopt(s, IPPROTO_TCP, TCP_USER_TIMEOUT, &user,  sizeof(int)) < 0)
+        return -1;
+
+    return 0;
+}
+
+
+
+/*
+    Listener set up for reconnect storms:  a real backlog (-B), non-blocking
+    for acceptSK() to drain it, options for accepted sockets to inherit, and
+    TCP Fast Open, so an effect that's been here before can send its name
+    with its SYN (the kernel needs net.ipv4.tcp_fastopen=3 for that).
+*/
+int listen_options(int s) {
+
+    int qlen = TCP_FASTOPEN_QLEN;
+
+    fcntl(s, F_SETFL, O_NONBLOCK);
+    sock_options(s);
+    setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(int));
+
+    return listen(s, LISTEN_Q);
 }
 
 
 
 /* close socket and clear named socket arrays */
 void closeSK(int socket, fd_set *open_sockets, hash_table_t *hashtable) {
+    set_effect_socket_sk(hashtable, socket, 0);     // first - forceCloseSK() forgets the effect
     forceCloseSK(socket, open_sockets);
-    set_effect_socket_sk(hashtable, socket, 0); 
 }
 
 
-/* just close socket */
+/* a new (effect) socket joins the open set, with fresh per-socket state */
+void add_socket(int cs, fd_set *open_sockets) {
+
+    FD_SET(cs, open_sockets);		        /* add socket to set of open sockets */
+    memset(&conns[cs], 0, sizeof(conn_t));
+    conns[cs].wheel_slot = -1;
+    conns[cs].last_seen  = millis();
+    if (IDLE_SECS)
+        wheel_add(cs, conns[cs].last_seen + IDLE_SECS*1000L);
+    STAT_ADD(stats.accepts, 1);
+    STAT_ADD(stats.conns, 1);
+    if (cs > max_socket) { max_socket = cs; }  	/* reset max */
+}
+
+
+
+/* just close socket (and drop anything waiting to go out on it) */
 void forceCloseSK(int fd, fd_set *open_sockets) {
+    if (FD_ISSET(fd, open_sockets) && conns[fd].kind == CONN_EFFECT) {
+        STAT_ADD(stats.conns, -1);
+        flight_note(FL_CLOSE, fd, (int)conns[fd].msgs_in, "");
+    }
+    estop_set(fd, 0);
+    wheel_remove(fd);
+    conns[fd].effect = NULL;
+    free(conns[fd].resp);
+    conns[fd].resp = NULL;
+    conns[fd].kind = CONN_EFFECT;
     close(fd);
     FD_CLR(fd, open_sockets);
+    conns[fd].out_len  = 0;
+    conns[fd].out_msgs = 0;
+    conns[fd].lat_mask = 0ULL;
+    conns[fd].num_streams = 0;
+    conns[fd].held        = 0;
+    conns[fd].chan_len    = 0;
+    conns[fd].lit         = 0;
+    conns[fd].known       = 0;
 }
 
 
@@ -651,6 +1710,7 @@ msg_t *new_msg(char *str, int sock, char *ipadd) {
 
     // allocate memory for new node
     if ((newmsg = (msg_t *)malloc(sizeof(msg_t))) == NULL) return NULL;
+    STAT_ADD(stats.msg_allocs, 1);
 
     char *part;
    
@@ -681,6 +1741,9 @@ msg_t *new_msg(char *str, int sock, char *ipadd) {
 
     newmsg->ipadd       = strdup(ipadd); 
 
+    newmsg->nameCode    = msg_code(newmsg->effectName);
+    newmsg->verbCode    = msg_code(newmsg->secondMsg);
+
     newmsg->next = NULL;
 
     return newmsg;
@@ -795,10 +1858,16 @@ event_t *readBuffer(int socket, fd_set *readable_sockets, fd_set *open_sockets,
         memset(buf,0,BUFLEN+1);	            // clear buffer 
 
         rc = read(socket, buf, BUFLEN);     // read to length of buffer
+        last_read = micros();
+        if (rc > 0) {
+            STAT_ADD(stats.bytes_in, rc);
+            conns[socket].last_seen = last_read/1000L;      // all the idle wheel needs from us
+        }
+        if (capture_file) capture_frame(rc > 0 ? CAP_DATA : CAP_CLOSE, socket, buf, rc > 0 ? rc : 0);
 
         if (rc < 1) { // nothing meaningful to read, closing socket.
 
-            if (DEBUG) { cur_time(); printf("x\tclosing socket:%d, can't read RC:%d\n",socket,rc);fflush(stdout); }
+            LOG(LV_ERROR, "x\tclosing socket:%d, can't read RC:%d\n",socket,rc);
             closeSK(socket, open_sockets, hashtable);
          
             // at this point fall out of the loop and return my_events
@@ -871,12 +1940,20 @@ event_t *readBuffer(int socket, fd_set *readable_sockets, fd_set *open_sockets,
                         if (last_string[0] != 0) {
 
                             // Process message here....
+                            STAT_ADD(stats.msgs_in, 1);
+                            STAT_ADD(conns[socket].msgs_in, 1);
                             my_msg = makeMsg(socket, last_string, open_sockets, readable_sockets, writeable_sockets, ipadd, hashtable);
 
                             // do something with a meaningful message.
                             // could return a timed sequence, which we set along with the start time
                             event_t *new_events;
                             new_events = processMsg(socket, my_msg, open_sockets, hashtable);
+                            if (new_events) {
+                                int n = 0;
+                                event_t *e;
+                                for (e = new_events; e != NULL; e = e->next) n++;
+                                flight_note(FL_SCHEDULE, socket, n, my_msg->effectName);
+                            }
                             my_events  = concat_events(my_events,new_events);
                             
                             free_msg(my_msg);
@@ -889,226 +1966,3805 @@ event_t *readBuffer(int socket, fd_set *readable_sockets, fd_set *open_sockets,
 
                     }
 
-                } else {                          // else buffer is empty, jumpt to end
-                    cur_pos = BUFLEN;
-                    rc      = 0;
-                }
+                } else {                          // else buffer is empty, jumpt to end
+                    cur_pos = BUFLEN;
+                    rc      = 0;
+                }
+
+            } // end while < BUFLEN
+
+        } // end if rc or partial
+
+    } // end while there's a buffer or a partial
+
+    return my_events;
+
+} // end readBuffer
+
+
+
+
+
+
+
+/* given an incoming message, do the right thing with that message */
+event_t *processMsg(int socket, msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    event_t   *timed_sequence;
+    handler_t *handler;
+    timed_sequence = NULL;
+
+
+    // skip mal-formed messages (no message at all/no identifier, no socket?)
+    if (!my_msg || !my_msg->whosTalking)
+        return NULL;
+
+    // show message if debugging
+    LOG(LV_DEBUG, "->  EFFECT:%s socket#:%02d msg1:'%s' msg2:'%s' msg3:'%s' msg4:'%s' \n",
+	my_msg->effectName,socket,my_msg->firstMsg,my_msg->secondMsg,my_msg->thirdMsg,my_msg->fourthMsg);
+
+    // no need to process empty messages or keep alive signals
+    if (my_msg->firstMsg == NULL || (my_msg->firstMsg && strcmp(my_msg->firstMsg,KeepAlive)==0))  
+        return NULL; 
+
+    flight_note(FL_DISPATCH, socket, 0, my_msg->effectName);
+
+    // rules first - they're the wiring
+    if (rules && strcmp(my_msg->firstMsg,CONTROL)!=0)
+        timed_sequence = rules_fire(my_msg, open_sockets, hashtable);
+
+
+    if (strcmp(my_msg->firstMsg,CONTROL)==0) {
+
+        // Handle a "control" message.
+        timed_sequence = doControl(my_msg, open_sockets, hashtable);
+
+    } else if (strcmp(my_msg->firstMsg,STREAM)==0) {
+
+        // A stream value - to the collection, newest only
+        lat_begin(LAT_STREAM, last_read);
+        stream_forward(my_msg, lookup_effect(hashtable, my_msg->effectName), open_sockets, hashtable);
+
+    } else if (strcmp(my_msg->firstMsg,PUBLISH)==0) {
+
+        // Published to a topic - to its subscribers
+        lat_begin(LAT_COLLECTION, last_read);
+        if (my_msg->secondMsg && my_msg->thirdMsg)
+            publish(my_msg->whosTalking, my_msg->secondMsg, my_msg->thirdMsg, open_sockets, hashtable, NULL);
+
+    } else if ((handler = find_handler(senders, my_msg->nameCode, my_msg->effectName)) != NULL) {
+
+        // Handle a message from an effect with its own handler (the button)
+        lat_begin(handler->lat_class, last_read);
+        timed_sequence = concat_events(timed_sequence,
+                                       handler->plugin ? plugin_call(handler->plugin, my_msg, open_sockets, hashtable)
+                                                       : handler->fn(my_msg, open_sockets, hashtable));
+
+    } else if (my_msg->firstMsg != NULL) {
+    
+        /*
+           All other messages currently wind up here.
+           If the incoming message is from an effect that has a
+           collection, we send the firstMsg on to that collection.
+
+           Otherwise, we currently do nothing.
+        */
+
+        list_t *self = lookup_effect(hashtable, my_msg->effectName);
+
+        if (self->collection != NULL) {
+            lat_begin(LAT_COLLECTION, last_read);
+            send_to_collection(my_msg, self, open_sockets, hashtable);
+        }
+            
+    } // end there's a message
+
+    lat_end();
+
+    return timed_sequence;
+
+} // end processMsg
+
+
+
+
+/* get ip address of a socket, into ipstr (INET6_ADDRSTRLEN) */
+void getip(int sn, char *ipstr) {
+    struct sockaddr_storage addr;
+    socklen_t csa = sizeof(addr);
+    ipstr[0] = '\0';
+    if (getpeername(sn, (struct sockaddr *)&addr, &csa) < 0) return;
+    if (addr.ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, ipstr, INET6_ADDRSTRLEN);
+    else if (addr.ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, ipstr, INET6_ADDRSTRLEN);
+}
+
+
+
+
+/* 
+    Set the name of the effect from the message, (re)-associate 
+    with a particular socket using a hash table as an associative
+    array.
+
+    Force close any socket no longer associated with a particular
+    effect.
+*/
+int namedSock (msg_t *my_msg, fd_set *open_sockets, fd_set *readable_sockets, fd_set *writeable_sockets, hash_table_t *hashtable) {
+
+    if (!my_msg || !my_msg->effectName || !my_msg->whosTalking) return 0;
+
+    // a returning effect with its token skips all the below
+    if (my_msg->secondMsg && strcmp(my_msg->secondMsg,RS)==0 &&
+        my_msg->firstMsg  && strcmp(my_msg->firstMsg,CONTROL)==0 &&
+        resume_session(my_msg, open_sockets, hashtable))
+        return 0;
+
+    list_t *anEffect = lookup_effect(hashtable, my_msg->effectName);
+
+    int aSock = 0;
+  
+    if (anEffect != NULL)
+         aSock = anEffect->socket_num;
+
+    if (aSock) { 
+ 
+        // already have a socket for this effect
+        
+        if (aSock != my_msg->whosTalking) {
+ 
+            // TWO sockets for the same effect.  Either it went offline and came back, or there's
+            // a duplicate (two same-named effects on different sockets)
+            if (strcmp(anEffect->ipadd, my_msg->ipadd)==0) {
+                flight_note(FL_RECONNECT, my_msg->whosTalking, aSock, my_msg->effectName);
+                forceCloseSK(aSock, open_sockets);
+                set_effect_socket(hashtable, my_msg->effectName, my_msg->whosTalking);
+                LOG(LV_INFO, "x   RE-CONNECT - FORCE close old socket on name:%s socket:%d, new socket:%d, ip:%s\n", 
+                   my_msg->effectName, aSock, my_msg->whosTalking, my_msg->ipadd);
+            } else {
+                // different ips - it's a duplicate effect.
+                LOG(LV_INFO, "xx  DUPLICATE EFFECT!! name:%s is already on socket:%d. IGNORING THIS EFFECT!\n", 
+                   my_msg->effectName, aSock);
+                STAT_ADD(stats.dups, 1);
+                flight_note(FL_DUPLICATE, my_msg->whosTalking, aSock, my_msg->effectName);
+                return 0;
+            }
+        } 
+    } else { 
+   
+        // no socket found for this effect
+
+        // existing effect found, update its socket
+        if (anEffect != NULL) {
+            set_effect_socket(hashtable,anEffect->effect,my_msg->whosTalking);  // update effect with new socket number
+            flight_note(FL_REGISTER, my_msg->whosTalking, 0, anEffect->effect);
+            LOG(LV_INFO, "updating known effect with now known socket#:%d\n",anEffect->socket_num);
+
+        // brand new effect, store it
+        } else {
+            if (my_msg) {
+                add_effect(hashtable, my_msg);    // new effect, add to hash table
+                flight_note(FL_REGISTER, my_msg->whosTalking, 1, my_msg->effectName);
+            }
+        }
+    }
+
+    // the emergency stop reaches everyone who'd get KILL_ALL, and
+    // closing the socket finds its effect without a search
+    if (aSock != my_msg->whosTalking)
+        anEffect = lookup_effect(hashtable, my_msg->effectName);
+    if (anEffect) {
+        estop_set(my_msg->whosTalking, !anEffect->do_not_send);
+        conns[my_msg->whosTalking].effect = anEffect;
+    }
+
+    // registered (again) on this socket - here's how to come back to it
+    if (anEffect && aSock != my_msg->whosTalking)
+        issue_token(my_msg, open_sockets, hashtable);
+
+    return 1;
+
+} // end namedSock
+
+
+
+
+/*
+    Session resumption.  An effect is sent a token, '$tk<token>%', when it
+    registers (and again for 'effect:*:TK') to keep.  When it drops and reconnects, its first words on the new socket
+    are 'effect:*:RS:<token>', and if the token's right, the effect - its
+    name, DS, collections, acks, and critical commands awaiting them - just
+    moves over to the new socket:  one hash lookup, no re-registering, no
+    ip comparisons (so a new DHCP lease is fine).  Anything still queued for
+    the old socket goes out on the new one, anything awaiting an ack is
+    resent (see check_acks()), and the table's marked modified, so everyone
+    else's collections pick up the new socket when next used.
+
+    Answers '$rs1%', or '$rs0%' if there's nothing to resume - the effect
+    should then register from scratch.  The time from reading the RS to the
+    first send on the new socket is in LT, as "resume".
+
+    Returns 1 if resumed (nothing more to do with the message), else 0.
+*/
+int resume_session(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    list_t *self  = lookup_effect(hashtable, my_msg->effectName);
+    int     sock  = my_msg->whosTalking;
+    int     old;
+
+    if (!self || !self->token || !my_msg->thirdMsg ||
+        strtoull(my_msg->thirdMsg, NULL, 16) != self->token) {
+        reply_msg(my_msg, open_sockets, "$rs0%", hashtable);
+        return 0;
+    }
+
+    old = self->socket_num;
+
+    if (old && old != sock && FD_ISSET(old, open_sockets)) {
+        if (conns[old].out_len)
+            queue_msg(sock, conns[old].out_buf, conns[old].out_len, open_sockets, hashtable);
+        forceCloseSK(old, open_sockets);
+    }
+
+    if (my_msg->ipadd && *my_msg->ipadd) {
+        free(self->ipadd);
+        self->ipadd = strdup(my_msg->ipadd);
+    }
+
+    self->socket_num    = sock;
+    self->resumed       = last_read;
+    conns[sock].effect  = self;
+    conns[sock].resumed = last_read;
+    hashtable->modified = millis();
+    eff_sync(self);
+    estop_set(sock, !self->do_not_send);
+    STAT_ADD(stats.resumes, 1);
+
+    flight_note(FL_RESUME, sock, old, self->effect);
+    LOG(LV_INFO, "->  RESUMED name:%s old socket:%d, new socket:%d\n", self->effect, old, sock);
+
+    reply_msg(my_msg, open_sockets, "$rs1%", hashtable);
+
+    return 1;
+}
+
+
+
+/* on registering, or 'effect:*:TK' - hand out the effect's resumption token, making one if need be */
+void issue_token(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    list_t *self = lookup_effect(hashtable, my_msg->effectName);
+    char    out[32];
+
+    if (!self) return;
+
+    while (!self->token) {
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd < 0 || read(fd, &self->token, sizeof(self->token)) != sizeof(self->token))
+            self->token = ((unsigned long long)micros() << 20) ^ (unsigned long long)getpid() ^ (uintptr_t)self;
+        if (fd >= 0) close(fd);
+    }
+
+    snprintf(out, sizeof(out), "$tk%016llx%%", self->token);
+    reply_msg(my_msg, open_sockets, out, hashtable);
+}
+
+
+
+
+/* 
+    Send messages out.  Confirm socket is open and ready.
+    Note that we just close any socket that can't accept messages.
+
+    Messages are queued on the socket and go out with flush_output()
+    at the end of the pass through the main loop - except KILL_ALL,
+    which is flushed immediately (along with anything queued ahead
+    of it, so ordering is kept).
+*/
+void send_msg (list_t *my_element, fd_set *open_sockets, char *msg, hash_table_t *hashtable) {
+
+    int   sock   = my_element->socket_num;
+    char *effect = my_element->effect;
+
+    if (!sock) { return; }
+ 
+    if (FD_ISSET(sock, open_sockets)) { 
+        int nBytes = strlen(msg) + 1;
+        if (!my_element->do_not_send && !state_msg(&conns[sock], msg)) {
+            STAT_ADD(stats.suppressed, 1);
+            LOG(LV_DEBUG, "xx  skipped message:'%s' to %10s on socket:%02d (already on)\n",msg,effect,sock);
+        } else if (!my_element->do_not_send) {
+            flight_note(FL_SEND, sock, nBytes, msg);
+            list_t *self = NULL;
+            if (is_critical(msg) && (self = lookup_effect(hashtable, effect)) != NULL && self->acks) 
+                send_acked(self, open_sockets, msg, hashtable);
+            else
+                queue_msg(sock, msg, nBytes, open_sockets, hashtable);
+            LOG(LV_DEBUG, "<-  queued message:'%s' to %10s on socket:%02d\n",msg,effect,sock);
+            if (strcmp(msg,KILL_ALL)==0)        // the kill lane never waits
+                flush_sock(sock, open_sockets, hashtable);
+        } else {
+            LOG(LV_DEBUG, "xx  skipped message:'%s' to %10s on socket:%02d (dns set)\n",msg,effect,sock);
+        }
+    } else { // close any unavailable socket
+        STAT_ADD(stats.drops, 1);
+        closeSK(sock, open_sockets, hashtable);
+        LOG(LV_ERROR, "x   closing socket:%d, can't write\n",sock);
+    }
+}
+
+
+
+
+/* add a message (including its terminating null) to a socket's pending output */
+void queue_msg(int sock, char *msg, int nBytes, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    conn_t *conn = &conns[sock];
+    int     i;
+
+    // plugins watching the output
+    if (num_outputs) {
+        in_output = 1;
+        for (i = 0; i < num_outputs; i++)
+            outputs[i](conn->effect ? conn->effect->effect : "", msg, nBytes-1);
+        in_output = 0;
+    }
+
+    // no room left - send what we have so far (any held tail too, waiting if need be), and start over
+    if (conn->out_len + nBytes > OUTBUFLEN) {
+        conn->held = 0;
+        flush_sock(sock, open_sockets, hashtable);
+    }
+
+    // (still) too big to gather, just send it as is
+    if (nBytes > OUTBUFLEN) {
+        int bsent = send(sock, msg, nBytes, MSG_NOSIGNAL);
+        STAT_ADD(stats.msgs_out, 1);
+        STAT_ADD(stats.sends, 1);
+        if (bsent > 0) STAT_ADD(stats.bytes_out, bsent);
+        LOG(LV_DEBUG, "<-  sent %d bytes to socket:%02d  bytes sent:%d\n",nBytes,sock,bsent);
+        return;
+    }
+
+    if (!conn->is_dirty) {
+        conn->is_dirty    = 1;
+        dirty[num_dirty++] = sock;
+    }
+
+    if (lat_cur >= 0) 
+        conn->lat_mask |= 1ULL << lat_cur;
+
+    memcpy(conn->out_buf + conn->out_len, msg, nBytes);
+    conn->out_len += nBytes;
+    conn->out_msgs++;
+    STAT_ADD(stats.msgs_out, 1);
+}
+
+
+
+/* send everything queued for a socket in a single send() */
+void flush_sock(int sock, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    conn_t *conn  = &conns[sock];
+    int     flags = MSG_NOSIGNAL;
+    int     i, n;
+
+    if (!conn->out_len && !conn->num_streams) return;
+
+    // nothing new since a stream-only send was cut short?  then the rest mustn't block either
+    if (conn->out_len && conn->out_len == conn->held) flags |= MSG_DONTWAIT;
+
+    // stream values go along - unless the link's behind, when they wait (for newer ones)
+    if (conn->num_streams && FD_ISSET(sock, open_sockets) && stream_room(sock)) {
+        if (!conn->out_len) flags |= MSG_DONTWAIT;
+        for (i = 0, n = 0; i < conn->num_streams; i++) {
+            if (conn->out_len + conn->streams[i].len > OUTBUFLEN) {
+                conn->streams[n++] = conn->streams[i];
+                continue;
+            }
+            memcpy(conn->out_buf + conn->out_len, conn->streams[i].text, conn->streams[i].len);
+            conn->out_len += conn->streams[i].len;
+            conn->out_msgs++;
+        }
+        conn->num_streams = n;
+    }
+
+    if (conn->out_len && FD_ISSET(sock, open_sockets)) {
+        int bsent = send(sock, conn->out_buf, conn->out_len, flags);
+        STAT_ADD(stats.sends, 1);
+
+        // a send that wasn't to wait, and didn't all fit:  keep the rest - the
+        // message it cut included - for next pass, rather than lose the framing
+        if ((flags & MSG_DONTWAIT) && bsent < conn->out_len && (bsent > 0 || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (bsent < 0) bsent = 0;
+            STAT_ADD(stats.bytes_out, bsent);
+            STAT_ADD(conn->bytes_out, bsent);
+            memmove(conn->out_buf, conn->out_buf + bsent, conn->out_len - bsent);
+            conn->out_len -= bsent;
+            conn->held     = conn->out_len;
+            for (i = 0, n = 0; i < conn->out_len; i++)
+                if (!conn->out_buf[i]) n++;
+            STAT_ADD(conn->msgs_out, conn->out_msgs - n);
+            conn->out_msgs = n;
+            if (conn->lat_mask)
+                lat_sent(conn->lat_mask);
+            conn->lat_mask = 0ULL;
+            conn->chan_len = 0;         // nothing to merge into, in a tail that's already half gone
+            LOG(LV_DEBUG, "<-  sent %d bytes to socket:%02d, %d held for next pass\n",bsent,sock,conn->out_len);
+            return;
+        }
+
+        if (bsent > 0) {
+            STAT_ADD(stats.bytes_out, bsent);
+            STAT_ADD(conn->msgs_out, conn->out_msgs);
+            STAT_ADD(conn->bytes_out, bsent);
+        } else {
+            STAT_ADD(stats.drops, conn->out_msgs);
+            STAT_ADD(conn->drops, conn->out_msgs);
+        }
+        if (bsent < conn->out_len)
+            conn->known = 0;            // some of what we told it may not get there
+        if (conn->lat_mask) 
+            lat_sent(conn->lat_mask);
+        if (conn->resumed && bsent > 0) {
+            hdr_record(&resume_lat, micros() - conn->resumed);
+            conn->resumed = 0;
+        }
+        LOG(LV_DEBUG, "<-  sent %d message(s) to socket:%02d  bytes sent:%d\n",conn->out_msgs,sock,bsent);
+    }
+
+    // may still be on dirty[], but empty - flush_output() will pass it by
+    conn->held     = 0;
+    conn->out_len  = 0;
+    conn->out_msgs = 0;
+    conn->lat_mask = 0ULL;
+    conn->chan_len = 0;
+}
+
+
+
+/* end of a pass through the main loop - flush every socket with pending output */
+void flush_output(fd_set *open_sockets, hash_table_t *hashtable) {
+
+    int i, n;
+
+    for (i=0, n=0; i<num_dirty; i++) {
+        flush_sock(dirty[i], open_sockets, hashtable);
+        if (conns[dirty[i]].num_streams || conns[dirty[i]].out_len)
+            dirty[n++] = dirty[i];      // stream values held back (or part sent) - try again next pass
+        else
+            conns[dirty[i]].is_dirty = 0;
+    }
+
+    num_dirty = n;
+
+    lat_record();
+}
+
+
+
+
+/*     Send message to all active sockets (self is ignored).   */
+void send_all(int whosTalking, fd_set *open_sockets, hash_table_t *hashtable, char *my_msg) {
+    send_ids(NULL, 0, 1, whosTalking, open_sockets, my_msg, hashtable, NULL);
+}
+
+
+
+
+/* process incoming control message - see register_verb() */
+event_t *doControl(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    handler_t *verb = find_handler(verbs, my_msg->verbCode, my_msg->secondMsg);
+
+    lat_begin(verb ? verb->lat_class : LAT_CONTROL, last_read);
+
+    if (verb == NULL) return NULL;      // (no verb, or one we don't know)
+
+    if (verb->plugin)
+        return plugin_call(verb->plugin, my_msg, open_sockets, hashtable);
+
+    return verb->fn(my_msg, open_sockets, hashtable);
+}
+
+
+
+
+
+/* MESSAGE HANDLER ROUTINES  */
+
+
+/* FNV-1a of a verb or effect name, never 0 (0 marks a free slot, and no name) */
+uint32_t msg_code(char *name) {
+
+    uint32_t code = 2166136261U;
+
+    if (name == NULL) return 0;
+
+    while (*name)
+        code = (code ^ (unsigned char)*name++) * 16777619U;
+
+    return code ? code : 1;
+}
+
+
+
+/*
+    Have fn handle control messages 'effect:*:<verb>...', timed as lat_class.
+    Registering a verb again replaces its handler.  Returns 0, or -1 if the
+    verb's too long or the table's full.
+*/
+int register_verb(char *verb, handler_fn fn, int lat_class) {
+    return register_handler(verbs, verb, fn, NULL, lat_class);
+}
+
+
+
+/* the same, for every message from the effect called name (but control messages) */
+int register_effect(char *name, handler_fn fn, int lat_class) {
+    return register_handler(senders, name, fn, NULL, lat_class);
+}
+
+
+
+/* (fn, or a plugin's handler) */
+int register_handler(handler_t *table, char *name, handler_fn fn, xc_handler_fn plugin, int lat_class) {
+
+    uint32_t code = msg_code(name);
+    int      i, n;
+
+    if (code == 0 || strlen(name) >= HANDLER_NAME) return -1;
+
+    for (n = 0, i = code & (HANDLER_SLOTS-1); n < HANDLER_SLOTS; n++, i = (i+1) & (HANDLER_SLOTS-1)) {
+
+        if (table[i].code == 0 || (table[i].code == code && strcmp(table[i].name, name) == 0)) {
+            table[i].code      = code;
+            table[i].lat_class = lat_class;
+            table[i].fn        = fn;
+            table[i].plugin    = plugin;
+            strcpy(table[i].name, name);
+            return 0;
+        }
+    }
+
+    LOG(LV_ERROR, "no room for a handler for %s\n", name);
+    return -1;
+}
+
+
+
+/* the handler for name (whose msg_code() is code), or NULL */
+handler_t *find_handler(handler_t *table, uint32_t code, char *name) {
+
+    int i, n;
+
+    if (code == 0) return NULL;
+
+    for (n = 0, i = code & (HANDLER_SLOTS-1); n < HANDLER_SLOTS && table[i].code; n++, i = (i+1) & (HANDLER_SLOTS-1))
+        if (table[i].code == code && strcmp(table[i].name, name) == 0)
+            return &table[i];
+
+    return NULL;
+}
+
+
+
+/* the verbs, and effects, we know out of the box */
+void register_handlers() {
+
+    register_verb(XX, verb_xx, LAT_KILL);       // kill all!
+    register_verb(RO, verb_ro, LAT_CONTROL);    // setting round order
+    register_verb(CC, verb_cc, LAT_CONTROL);    // creating a collection
+    register_verb(DS, verb_ds, LAT_CONTROL);    // don't-send flag
+    register_verb(TS, verb_ts, LAT_CONTROL);    // clock sync
+    register_verb(OK, verb_ok, LAT_CONTROL);    // ack for a critical command
+    register_verb(AK, verb_ak, LAT_CONTROL);    // ack flag
+    register_verb(LT, verb_lt, LAT_CONTROL);    // latency report
+    register_verb(ST, verb_st, LAT_CONTROL);    // stats report
+    register_verb(TK, verb_tk, LAT_CONTROL);    // resumption token
+    register_verb(RS, verb_rs, LAT_CONTROL);    // resume - if we're here, it didn't
+    register_verb(SU, verb_su, LAT_CONTROL);    // subscribe to topics
+    register_verb(UN, verb_un, LAT_CONTROL);    // and unsubscribe
+    register_verb(SC, verb_sc, LAT_CONTROL);    // send a command, to an effect or its sub-channels
+    register_verb(LS, verb_ls, LAT_CONTROL);    // what's lit
+
+    register_effect(BUTTON, doButton, LAT_BUTTON);
+}
+
+
+
+event_t *verb_xx(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    send_all(my_msg->whosTalking, open_sockets, hashtable, KILL_ALL);
+    return NULL;
+}
+
+event_t *verb_ro(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    set_list_order(hashtable, my_msg);
+    return NULL;
+}
+
+event_t *verb_cc(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    set_collection(hashtable, my_msg);
+    return NULL;
+}
+
+event_t *verb_ds(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    set_effect_ds(hashtable, my_msg->effectName, my_msg->thirdMsg);
+    return NULL;
+}
+
+event_t *verb_ts(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    sync_clock(my_msg, open_sockets, hashtable);
+    return NULL;
+}
+
+event_t *verb_ok(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    got_ack(my_msg, hashtable);
+    return NULL;
+}
+
+event_t *verb_ak(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    set_effect_acks(hashtable, my_msg->effectName, my_msg->thirdMsg);
+    return NULL;
+}
+
+event_t *verb_lt(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    report_latency(my_msg, open_sockets, hashtable);
+    return NULL;
+}
+
+event_t *verb_st(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    report_stats(my_msg, open_sockets, hashtable);
+    return NULL;
+}
+
+event_t *verb_tk(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    issue_token(my_msg, open_sockets, hashtable);
+    return NULL;
+}
+
+event_t *verb_rs(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    return NULL;                        // resume_session() has it, before we get here
+}
+
+event_t *verb_su(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    subscribe(my_msg->effectName, my_msg->thirdMsg);
+    return NULL;
+}
+
+event_t *verb_un(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    unsubscribe(my_msg->effectName, my_msg->thirdMsg);
+    return NULL;
+}
+
+event_t *verb_sc(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    char cmd[CHAN_CMD+2];
+    if (my_msg->thirdMsg && my_msg->fourthMsg && snprintf(cmd, sizeof(cmd), "$%s%%", my_msg->fourthMsg) < (int)sizeof(cmd))
+        rule_send(my_msg->thirdMsg, cmd, my_msg->whosTalking, open_sockets, hashtable);
+    return NULL;
+}
+
+event_t *verb_ls(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+    report_lit(my_msg, open_sockets, hashtable);
+    return NULL;
+}
+
+
+
+
+
+
+
+
+/* PLUGIN ROUTINES  */
+
+
+const xc_host_t host = {
+    XC_PLUGIN_ABI, sizeof(xc_host_t),
+    host_register_verb, host_register_effect, host_register_output,
+    host_send, host_send_all, host_poof,
+    host_log, host_micros
+};
+
+
+
+/*
+    (Re)load the plugins:  every *.so in dir, in name order.  The old ones
+    are finished and unloaded first, and the dispatch table put back as
+    we have it - so a plugin taken out takes its verbs with it.  Connections,
+    the registry and sequences under way aren't touched.
+*/
+void plugins_load(char *dir) {
+
+    struct dirent **names;
+    char            path[PATH_MAX];
+    int             n, i;
+
+    plugins_unload();
+
+    if ((n = scandir(dir, &names, plugin_file, alphasort)) < 0) {
+        LOG(LV_ERROR, "xx  plugins: can't read %s\n", dir);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+        if (num_plugins < PLUGIN_MAX) 
+            plugin_open(path);
+        else
+            LOG(LV_ERROR, "xx  plugins: no room for %s\n", path);
+        free(names[i]);
+    }
+    free(names);
+
+    LOG(LV_INFO, "    %d plugins loaded from %s\n", num_plugins, dir);
+}
+
+
+
+/* finish and unload every plugin, and forget their handlers */
+void plugins_unload() {
+
+    void (*fini)(void);
+    int    i;
+
+    memset(verbs,   0, sizeof(verbs));
+    memset(senders, 0, sizeof(senders));
+    num_outputs = 0;
+    register_handlers();
+
+    for (i = 0; i < num_plugins; i++) {
+        if ((fini = dlsym(plugins[i], "xc_plugin_fini")) != NULL)
+            fini();
+        dlclose(plugins[i]);
+    }
+    num_plugins = 0;
+}
+
+
+
+/* scandir() filter - *.so */
+int plugin_file(const struct dirent *d) {
+
+    size_t len = strlen(d->d_name);
+
+    return len > 3 && strcmp(d->d_name + len - 3, ".so") == 0;
+}
+
+
+
+/*
+    Load one plugin, if it's built for our ABI and its init says yes.  If
+    it says no, whatever it registered first is undone.
+*/
+void plugin_open(char *path) {
+
+    static handler_t had_verbs[HANDLER_SLOTS], had_senders[HANDLER_SLOTS];
+    int              had_outputs = num_outputs;
+    int            (*init)(const xc_host_t *);
+    int             *abi;
+    void            *lib;
+
+    if ((lib = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        LOG(LV_ERROR, "xx  plugin %s: %s\n", path, dlerror());
+        return;
+    }
+
+    abi  = dlsym(lib, "xc_plugin_abi");
+    init = dlsym(lib, "xc_plugin_init");
+
+    if (abi == NULL || *abi != XC_PLUGIN_ABI || init == NULL) {
+        LOG(LV_ERROR, "xx  plugin %s: not built for plugin ABI %d\n", path, XC_PLUGIN_ABI);
+        dlclose(lib);
+        return;
+    }
+
+    memcpy(had_verbs,   verbs,   sizeof(verbs));
+    memcpy(had_senders, senders, sizeof(senders));
+
+    plugin_loading = 1;
+    int rc = init(&host);
+    plugin_loading = 0;
+
+    if (rc != 0) {
+        LOG(LV_ERROR, "xx  plugin %s: init failed (%d)\n", path, rc);
+        memcpy(verbs,   had_verbs,   sizeof(verbs));
+        memcpy(senders, had_senders, sizeof(senders));
+        num_outputs = had_outputs;
+        dlclose(lib);
+        return;
+    }
+
+    plugins[num_plugins++] = lib;
+    LOG(LV_INFO, "    plugin %s loaded\n", path);
+}
+
+
+
+/* SIGHUP - the main loop reloads plugins and rules, between passes */
+void reload_signal(int sig) {
+    reload_wanted = 1;
+}
+
+
+
+/*
+    Run a plugin's handler on a message.  It gets the message's parts, and
+    what it calls back on (send, poof...) acts on this message's sockets
+    and table;  any poofs it asked for come back as the timed sequence.
+*/
+event_t *plugin_call(xc_handler_fn fn, msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    xc_msg_t msg = { my_msg->effectName, my_msg->firstMsg, my_msg->secondMsg,
+                     my_msg->thirdMsg, my_msg->fourthMsg, my_msg->whosTalking };
+    event_t *seq;
+
+    plugin_msg     = my_msg;
+    plugin_sockets = open_sockets;
+    plugin_table   = hashtable;
+    plugin_seq     = NULL;
+    plugin_t0      = millis();
+
+    fn(&msg);
+
+    seq            = plugin_seq;
+    plugin_msg     = NULL;
+    plugin_seq     = NULL;
+
+    return seq;
+}
+
+
+
+/* the host's side of xc-plugin.h - see there */
+
+int host_register_verb(const char *verb, xc_handler_fn fn) {
+    if (!plugin_loading || fn == NULL) return -1;
+    return register_handler(verbs, (char *)verb, NULL, fn, LAT_CONTROL);
+}
+
+int host_register_effect(const char *name, xc_handler_fn fn) {
+    if (!plugin_loading || fn == NULL) return -1;
+    return register_handler(senders, (char *)name, NULL, fn, LAT_BUTTON);
+}
+
+int host_register_output(xc_output_fn fn) {
+    if (!plugin_loading || fn == NULL || num_outputs >= OUTPUT_MAX) return -1;
+    outputs[num_outputs++] = fn;
+    return 0;
+}
+
+int host_send(const char *effect, const char *msg) {
+
+    list_t *eff;
+
+    if (plugin_msg == NULL || in_output) return -1;
+    if ((eff = lookup_effect(plugin_table, (char *)effect)) == NULL || !eff->socket_num) return -1;
+
+    send_msg(eff, plugin_sockets, (char *)msg, plugin_table);
+    return 0;
+}
+
+void host_send_all(const char *msg) {
+    if (plugin_msg == NULL || in_output) return;
+    send_all(plugin_msg->whosTalking, plugin_sockets, plugin_table, (char *)msg);
+}
+
+int host_poof(const char *effect, long begin_ms, long length_ms) {
+
+    list_t *eff;
+
+    if (plugin_msg == NULL || in_output) return -1;
+    if ((eff = lookup_effect(plugin_table, (char *)effect)) == NULL) return -1;
+
+    plugin_seq = concat_events(plugin_seq, new_event("poof", begin_ms, length_ms, copy_node(eff), plugin_t0));
+    return 0;
+}
+
+void host_log(const char *text) {
+    LOG(LV_INFO, "    plugin: %s\n", text);
+}
+
+long long host_micros(void) {
+    return micros();
+}
+
+
+
+
+
+
+
+
+/* RULE ROUTINES  */
+
+
+/*
+    Load the rule file - one rule a line, '#' for comments:
+
+        # when      sends   send    to       after (ms, optional)
+        B           2:1     $p1%    LULU     0
+        ORGAN       hit     $p0%    *        250
+
+    "sends" is everything after the effect's name and colon, "*" as a target
+    is everyone but the sender.  The new rules replace the old only if the
+    file could be read - a typo costs that line, not the show.
+*/
+void rules_load(char *path) {
+
+    char     line[BUFLEN], *f[6], *save;
+    FILE    *fp;
+    rules_t *r;
+    int      n, nf, bad = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        LOG(LV_ERROR, "xx  rules: can't read %s, keeping what we had\n", path);
+        return;
+    }
+    if ((r = malloc(sizeof(rules_t))) == NULL) {
+        fclose(fp);
+        return;
+    }
+    r->count = 0;
+    memset(r->index, -1, sizeof(r->index));
+
+    for (n = 1; fgets(line, sizeof(line), fp) != NULL; n++) {
+
+        if (strchr(line, '#')) *strchr(line, '#') = '\0';
+
+        for (nf = 0, f[0] = strtok_r(line, " \t\r\n", &save); f[nf] != NULL && nf < 5; )
+            f[++nf] = strtok_r(NULL, " \t\r\n", &save);
+
+        if (nf == 0) continue;
+
+        if (nf < 4 || (nf == 5 && f[5] != NULL) ||
+            rule_add(r, f[0], f[1], f[2], f[3], nf == 5 ? atol(f[4]) : 0L) < 0) {
+            LOG(LV_ERROR, "xx  rules: %s line %d ignored\n", path, n);
+            bad++;
+        }
+    }
+    fclose(fp);
+
+    free(rules);
+    rules = r;
+
+    LOG(LV_INFO, "    %d rules loaded from %s (%d bad)\n", r->count, path, bad);
+}
+
+
+
+/* add a rule to r, after any others for the same effect and msg - 0, or -1 if it won't go */
+int rule_add(rules_t *r, char *effect, char *msg, char *cmd, char *target, long delay) {
+
+    rule_t  *rule;
+    uint32_t name_code = msg_code(effect), code = msg_code(msg);
+    int      i, n, last;
+
+    if (r->count >= RULE_MAX || delay < 0 ||
+        strlen(effect) >= RULE_TEXT || strlen(msg) >= RULE_TEXT ||
+        strlen(cmd) >= RULE_TEXT || strlen(target) >= RULE_TEXT)
+        return -1;
+
+    rule            = &r->rule[r->count];
+    rule->name_code = name_code;
+    rule->msg_code  = code;
+    rule->delay     = delay;
+    rule->next      = -1;
+    strcpy(rule->effect, effect);
+    strcpy(rule->msg,    msg);
+    strcpy(rule->cmd,    cmd);
+    strcpy(rule->target, target);
+
+    for (n = 0, i = (name_code ^ code*2654435761U) & (RULE_SLOTS-1); n < RULE_SLOTS; n++, i = (i+1) & (RULE_SLOTS-1)) {
+
+        if (r->index[i] < 0) {
+            r->index[i] = r->count++;
+            return 0;
+        }
+
+        rule_t *first = &r->rule[r->index[i]];
+        if (first->name_code == name_code && first->msg_code == code &&
+            strcmp(first->effect, effect) == 0 && strcmp(first->msg, msg) == 0) {
+            for (last = r->index[i]; r->rule[last].next >= 0; last = r->rule[last].next)
+                ;
+            r->rule[last].next = r->count++;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+
+/* the first rule for effect sending msg (their codes, name_code and code), or -1 */
+int rule_find(rules_t *r, uint32_t name_code, uint32_t code, char *effect, char *msg) {
+
+    int i, n;
+
+    for (n = 0, i = (name_code ^ code*2654435761U) & (RULE_SLOTS-1); n < RULE_SLOTS && r->index[i] >= 0; n++, i = (i+1) & (RULE_SLOTS-1)) {
+        rule_t *first = &r->rule[r->index[i]];
+        if (first->name_code == name_code && first->msg_code == code &&
+            strcmp(first->effect, effect) == 0 && strcmp(first->msg, msg) == 0)
+            return r->index[i];
+    }
+
+    return -1;
+}
+
+
+
+/*
+    Fire the rules for a message:  sends with no delay go now, the rest
+    come back as a timed sequence, for check_events().
+*/
+event_t *rules_fire(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    char     msg[BUFLEN];
+    char    *part[4] = { my_msg->firstMsg, my_msg->secondMsg, my_msg->thirdMsg, my_msg->fourthMsg };
+    event_t *seq = NULL, *event;
+    long     now;
+    int      i, len, r;
+
+    // put back what the effect sent, after its name
+    for (i = 0, len = 0; i < 4 && part[i] != NULL; i++)
+        len += snprintf(msg + len, sizeof(msg) - len, "%s%s", i ? COLON : "", part[i]);
+
+    if ((r = rule_find(rules, my_msg->nameCode, msg_code(msg), my_msg->effectName, msg)) < 0)
+        return NULL;
+
+    lat_begin(LAT_RULE, last_read);
+    now = millis();
+
+    for (; r >= 0; r = rules->rule[r].next) {
+
+        rule_t *rule = &rules->rule[r];
+
+        if (rule->delay == 0) {
+            rule_send(rule->target, rule->cmd, my_msg->whosTalking, open_sockets, hashtable);
+            continue;
+        }
+
+        if ((event = new_event("send", rule->delay, 0L, NULL, now)) == NULL) continue;
+        event->msg    = strdup(rule->cmd);
+        event->target = strdup(rule->target);
+        event->from   = my_msg->whosTalking;
+        seq = concat_events(seq, event);
+    }
+
+    lat_end();
+
+    return seq;
+}
+
+
+
+/* send msg to target - an effect, some of its sub-channels ("ORGAN->3+4"), or "*" for all but 'from' */
+void rule_send(char *target, char *msg, int from, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    char     name[RULE_TEXT];
+    uint32_t mask = 0;
+    list_t  *eff;
+
+    if (strcmp(target, CONTROL) == 0)
+        send_all(from, open_sockets, hashtable, msg);
+    else if (strstr(target, ARROW) == NULL) {
+        if ((eff = lookup_effect(hashtable, target)) != NULL && eff->socket_num)
+            send_msg(eff, open_sockets, msg, hashtable);
+    } else if (chan_name(target, name, sizeof(name)) && chan_parse(strstr(target, ARROW) + 2, &mask) == 0 &&
+               (eff = lookup_effect(hashtable, name)) != NULL && eff->socket_num)
+        chan_send(eff, mask, msg, open_sockets, hashtable);
+}
+
+
+
+
+
+
+
+/*
+    Clock sync, NTP style:  an effect sends 'effect:*:TS:<t0>' with its own
+    clock in microseconds, and gets back '$ts<t0>,<t1>,<t2>%' with our
+    receive and send times.  From its receive time <t3> it has
+
+        offset = ((t1 - t0) + (t2 - t3)) / 2
+        delay  = (t3 - t0) - (t2 - t1)
+
+    and keeps the offset from the lowest delay of several tries.  Once an
+    effect has asked, it's "synced", and timed sequences are shipped to it
+    ahead of time (see ship_event()), to be carried out on the shared
+    clock - so wifi jitter no longer moves the poofs around.
+
+    The reply is flushed right away, it's no good to anyone late.
+*/
+void sync_clock(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    long long t1   = micros();
+    list_t   *self = lookup_effect(hashtable, my_msg->effectName);
+    char      reply[80];
+
+    if (self == NULL || my_msg->thirdMsg == NULL) return;
+
+    self->synced = 1;
+
+    snprintf(reply, sizeof(reply), "$ts%.20s,%lld,%lld%%", my_msg->thirdMsg, t1, micros());
+    send_msg(self, open_sockets, reply, hashtable);
+    flush_sock(self->socket_num, open_sockets, hashtable);
+}
+
+
+
+/* send '$<cmd>%' as the timed command '$@<at_us>,<cmd>%' */
+void send_timed(list_t *my_element, fd_set *open_sockets, long long at_us, char *msg, hash_table_t *hashtable) {
+
+    char timed[64];
+
+    snprintf(timed, sizeof(timed), "$@%lld,%.*s%%", at_us, (int)strlen(msg)-2, msg+1);
+    send_msg(my_element, open_sockets, timed, hashtable);
+}
+
+
+
+
+/* answer whoever sent my_msg, directly - DS or no, it asked */
+void reply_msg(msg_t *my_msg, fd_set *open_sockets, char *msg, hash_table_t *hashtable) {
+    if (FD_ISSET(my_msg->whosTalking, open_sockets))
+        queue_msg(my_msg->whosTalking, msg, strlen(msg)+1, open_sockets, hashtable);
+}
+
+
+
+
+/* STREAM ROUTINES  */
+
+
+/*
+    A stream value, 'effect:~:<channel>:<value>', goes to the sender's
+    collection as $~<channel>,<value>% - but into a slot per channel on each
+    socket, not its queue:  a newer value for the same channel replaces one
+    that hasn't gone out.  flush_sock() sends what's in the slots with the
+    rest of the pass's output, unless the link is behind (stream_room()),
+    when they stay for the next pass - so the effect gets the freshest
+    value as soon as it can take one, and stale ones never queue.
+*/
+void stream_forward(msg_t *my_msg, list_t *self, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    char    text[STREAM_LEN];
+    int     plen, len;
+    list_t *node;
+
+    if (self == NULL || my_msg->secondMsg == NULL || my_msg->thirdMsg == NULL) return;
+
+    plen = snprintf(text, sizeof(text), "$~%s,", my_msg->secondMsg);
+    len  = snprintf(text + plen, sizeof(text) - plen, "%s%%", my_msg->thirdMsg) + plen;
+    if (len >= STREAM_LEN) return;
+
+    if (self->collection != NULL && self->c_mod != hashtable->modified)
+        update_collection(hashtable, self);
+
+    for (node = self->collection; node != NULL; node = node->next) {
+        int sock = node->socket_num;
+        if (!sock || sock == self->socket_num || node->do_not_send || !FD_ISSET(sock, open_sockets)) continue;
+        stream_put(sock, my_msg->verbCode, text, plen, len + 1);
+    }
+}
+
+
+
+/* put a stream message (len, with its null) in the socket's slot for its channel */
+void stream_put(int sock, uint32_t code, char *text, int plen, int len) {
+
+    conn_t *conn = &conns[sock];
+    int     i;
+
+    for (i = 0; i < conn->num_streams; i++)
+        if (conn->streams[i].code == code && conn->streams[i].plen == plen &&
+            strncmp(conn->streams[i].text, text, plen) == 0)
+            break;
+
+    if (i < conn->num_streams)
+        STAT_ADD(stats.coalesced, 1);
+    else if (conn->num_streams < STREAM_SLOTS) {
+        conn->num_streams++;
+        STAT_ADD(stats.msgs_out, 1);
+    } else {
+        STAT_ADD(stats.drops, 1);
+        STAT_ADD(conn->drops, 1);
+        return;
+    }
+
+    conn->streams[i].code = code;
+    conn->streams[i].plen = plen;
+    conn->streams[i].len  = len;
+    memcpy(conn->streams[i].text, text, len);
+
+    if (!conn->is_dirty) {
+        conn->is_dirty    = 1;
+        dirty[num_dirty++] = sock;
+    }
+
+    if (lat_cur >= 0) 
+        conn->lat_mask |= 1ULL << lat_cur;
+}
+
+
+
+/* 1 if the link is keeping up - little enough still unsent that stream values can go */
+int stream_room(int sock) {
+
+    int unsent = 0;
+
+    if (ioctl(sock, SIOCOUTQ, &unsent) < 0) return 1;
+
+    return unsent < STREAM_BACKLOG;
+}
+
+
+
+
+
+
+
+
+/* SUB-CHANNEL ROUTINES  */
+
+
+/* send msg to an effect on a list - all of it, or just the sub-channels the list names */
+void send_to(list_t *node, fd_set *open_sockets, char *msg, hash_table_t *hashtable) {
+
+    if (node->chans)
+        chan_send(node, node->chans, msg, open_sockets, hashtable);
+    else
+        send_msg(node, open_sockets, msg, hashtable);
+}
+
+
+
+/*
+    Send a command ($p1%, or plain p1) to some of an effect's sub-channels,
+    as $c<mask>,p1%.  If the last thing queued for that socket is the same
+    command to other channels, it's rewritten in place, with the masks
+    or'ed together - so a round, a rule or a collection that sets each of
+    the organ's poofers in turn sends it one message, not twelve.  Only
+    the last message queued is ever merged, so nothing's reordered.
+*/
+void chan_send(list_t *eff, uint32_t mask, char *msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    char    cmd[CHAN_CMD], text[CHAN_CMD+16];
+    int     sock = eff->socket_num, len;
+    conn_t *conn = &conns[sock];
+
+    if (!sock || !mask) return;
+
+    // the command, without its $ %
+    len = strlen(msg);
+    if (len >= 2 && msg[0] == '$' && msg[len-1] == '%') { msg++; len -= 2; }
+    if (len >= CHAN_CMD) return;
+    memcpy(cmd, msg, len);
+    cmd[len] = '\0';
+
+    // only the channels it'd change (and if that's none, we're done)
+    if (!eff->do_not_send && FD_ISSET(sock, open_sockets) &&
+        (mask = state_need(conn, mask, state_of(cmd, len))) == 0) {
+        STAT_ADD(stats.suppressed, 1);
+        return;
+    }
+
+    if (conn->chan_len && conn->out_len == conn->chan_at + conn->chan_len && strcmp(conn->chan_cmd, cmd) == 0) {
+        mask          |= conn->chan_mask;
+        conn->out_len  = conn->chan_at;
+        conn->out_msgs--;
+        STAT_ADD(stats.msgs_out, -1);
+    }
+    conn->chan_len = 0;
+
+    len = snprintf(text, sizeof(text), "$c%x,%s%%", mask, cmd);
+    send_msg(eff, open_sockets, text, hashtable);
+
+    // queued (and last)?  then the next may be merged with it.  not if it went
+    // out acked:  it's queued tagged, $#<id>,c3f,p0%, and its pending[] slot
+    // has the mask - so it's left alone, and the next stop is acked on its own
+    if (FD_ISSET(sock, open_sockets) && conn->out_len >= len+1 &&
+        memcmp(conn->out_buf + conn->out_len - (len+1), text, len+1) == 0) {
+        conn->chan_at   = conn->out_len - (len+1);
+        conn->chan_len  = len+1;
+        conn->chan_mask = mask;
+        strcpy(conn->chan_cmd, cmd);
+    }
+}
+
+
+
+/* "3+4", "1-12", "1-4+9" - channels to a mask.  0, or -1 if it's not that */
+int chan_parse(char *spec, uint32_t *mask) {
+
+    long  from, to;
+    char *end;
+
+    *mask = 0;
+
+    while (*spec) {
+        from = strtol(spec, &end, 10);
+        to   = (*end == '-') ? strtol(end+1, &end, 10) : from;
+        if (end == spec || from < 1 || to < from || to > CHAN_MAX || (*end && *end != '+')) return -1;
+        for (; from <= to; from++)
+            *mask |= 1U << (from-1);
+        spec = *end ? end+1 : end;
+    }
+
+    return *mask ? 0 : -1;
+}
+
+
+
+/* the effect's name from "ORGAN->3+4", into name - or NULL if it won't fit */
+char *chan_name(char *target, char *name, int size) {
+
+    int len = strstr(target, ARROW) - target;
+
+    if (len >= size) return NULL;
+    memcpy(name, target, len);
+    name[len] = '\0';
+
+    return name;
+}
+
+
+
+/* (registry snapshot) "->3+4" for a list node with sub-channels, else "" */
+void chan_format(list_t *node, char *buf, int size) {
+
+    int n, len = 0;
+
+    buf[0] = '\0';
+    if (!node->chans) return;
+
+    for (n = 0; n < CHAN_MAX; n++)
+        if (node->chans & (1U << n))
+            len += snprintf(buf + len, size - len, "%s%d", len ? "+" : ARROW, n+1);
+}
+
+
+
+
+
+
+
+
+/* STATE ROUTINES  */
+
+
+/*
+    What each effect is doing, as far as we know - what we last told it,
+    per channel, in its conn_t (so a new connection starts out unknown).
+    $p1% and $p0% are all its channels, $c<mask>,p1% those in the mask,
+    and KILL_ALL is everything off.  Anything else that might poof -
+    $p2%, a timed command - and we no longer know.  Nor do we after a
+    send that didn't all go, or an emergency stop.
+
+    A poof to channels we know are already poofing isn't sent (chan_send()
+    drops just those channels).  Stops are never dropped:  they're cheap,
+    and an effect may well have lit itself - a game's own poofers.
+
+    Returns 0 if msg shouldn't be sent, else 1 (and we've noted it).
+*/
+int state_msg(conn_t *conn, char *msg) {
+
+    uint32_t  mask = ~0U;
+    char     *cmd  = msg+1, *end;
+    int       len  = strlen(msg);
+
+    if (strcmp(msg, KILL_ALL) == 0) {
+        state_set(conn, ~0U, 0);
+        return 1;
+    }
+
+    if (len < 3 || msg[0] != '$' || msg[len-1] != '%') return 1;
+
+    if (*cmd == 'c') {
+        mask = strtoul(cmd+1, &end, 16);
+        if (*end != ',') return 1;
+        cmd = end+1;
+    } else if (*cmd != 'p' && *cmd != '@') {
+        return 1;
+    }
+
+    len = msg+len-1 - cmd;
+    if ((mask = state_need(conn, mask, state_of(cmd, len))) == 0) return 0;
+
+    state_set(conn, mask, state_of(cmd, len));
+    return 1;
+}
+
+
+
+/* a command without its $ % - 1 for p1 (poof), 0 for p0 (stop), -1 for anything else */
+int state_of(char *cmd, int len) {
+    if (len == 2 && cmd[0] == 'p' && (cmd[1] == '0' || cmd[1] == '1')) return cmd[1] - '0';
+    return -1;
+}
+
+
+
+/* the channels in mask a command would change - all of them, unless it's a poof */
+uint32_t state_need(conn_t *conn, uint32_t mask, int on) {
+    state_check(conn);
+    return (on == 1) ? mask & ~(conn->known & conn->lit) : mask;
+}
+
+
+
+/* note a command (on from state_of()) sent to the channels in mask */
+void state_set(conn_t *conn, uint32_t mask, int on) {
+
+    state_check(conn);
+
+    if (on < 0) {
+        conn->known &= ~mask;
+        return;
+    }
+
+    conn->known |= mask;
+    if (on) conn->lit |=  mask;
+    else    conn->lit &= ~mask;
+}
+
+
+
+/* an emergency stop since we last looked?  (its thread sent KILL_ALL, not us) */
+void state_check(conn_t *conn) {
+
+    long gen = __atomic_load_n(&estop_gen, __ATOMIC_ACQUIRE);
+
+    if (conn->lit_gen != gen) {
+        conn->lit_gen = gen;
+        conn->known   = 0;
+    }
+}
+
+
+
+/*
+    'effect:*:LS[:<effect>]' - what's lit, one line an online effect:  on
+    (all of it), off, or the channels poofing, "3+4" - with a ? after if
+    we don't know about the rest ("?" alone, nothing at all).
+*/
+void report_lit(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    int      i, n, clen;
+    list_t  *effect;
+
+    int   size = 64 + 160*hash_table_count(hashtable);
+    char *out  = malloc(size);
+    int   len  = 0;
+
+    if (out == NULL) return;
+
+    len += snprintf(out+len, size-len, "effect           lit\n");
+
+    for (i=0; i<hashtable->size; i++) {
+        for (effect = hashtable->table[i]; effect != NULL; effect = effect->next) {
+
+            conn_t *conn = &conns[effect->socket_num];
+
+            if (!effect->socket_num) continue;
+            if (my_msg->thirdMsg != NULL && strcmp(my_msg->thirdMsg, effect->effect) != 0) continue;
+
+            state_check(conn);
+            len += snprintf(out+len, size-len, "%-16.16s ", effect->effect);
+
+            if (!conn->known)
+                len += snprintf(out+len, size-len, "?\n");
+            else if ((conn->known & conn->lit) == ~0U)
+                len += snprintf(out+len, size-len, "on\n");
+            else {
+                for (n = 0, clen = 0; n < CHAN_MAX; n++)
+                    if (conn->known & conn->lit & (1U << n))
+                        clen += snprintf(out+len+clen, size-len-clen, "%s%d", clen ? "+" : "", n+1);
+                if (!clen)
+                    clen = snprintf(out+len, size-len, "off");
+                len += clen;
+                len += snprintf(out+len, size-len, "%s\n", conn->known == ~0U ? "" : " ?");
+            }
+        }
+    }
+
+    reply_msg(my_msg, open_sockets, out, hashtable);
+    free(out);
+}
+
+
+
+
+
+
+
+
+/* TOPIC ROUTINES  */
+
+
+/*
+    Publish msg to topic (levels split by '/', "stage/north/flame/3"):  it
+    goes to every effect subscribed to a pattern matching it - the topic
+    itself, or with "*" for any one level, or "#" for that level and all
+    below ("stage/#").  Whoever's subscribed is worked out the first time
+    a topic's published, and kept (topic_subs()), so this costs one hash
+    probe and a send per subscriber - however many effects there are.
+
+    With sent (a collection's topics), sockets in it have had msg already,
+    and those sent it here are added - so no effect gets it twice.
+*/
+void publish(int whosTalking, char *topic, char *msg, fd_set *open_sockets, hash_table_t *hashtable, fd_set *sent) {
+
+    topic_hit_t *hit = topic_subs(topic, hashtable);
+    list_t      *node;
+
+    if (hit == NULL) return;
+
+    if (sent == NULL) {
+        sendto_msg_list(whosTalking, hit->subs, open_sockets, hashtable, msg);
+        return;
+    }
+
+    for (node = hit->subs; node != NULL; node = node->next) {
+        if (!node->socket_num || node->socket_num == whosTalking || FD_ISSET(node->socket_num, sent))
+            continue;
+        send_to(node, open_sockets, msg, hashtable);
+        if (!node->chans)
+            FD_SET(node->socket_num, sent);     // other sub-channels of it may still be subscribed
+    }
+}
+
+
+
+/* the (cached) subscribers to a topic, up to date with subscriptions and sockets */
+topic_hit_t *topic_subs(char *topic, hash_table_t *hashtable) {
+
+    uint32_t     code = msg_code(topic);
+    topic_hit_t *hit  = &topic_cache[code & (TOPIC_CACHE-1)];
+    char         copy[TOPIC_LEN], *levels[TOPIC_LEVELS];
+    list_t      *names = NULL, *name, *eff, *node;
+    int          n;
+
+    if (hit->code != code || strcmp(hit->topic, topic) != 0 || hit->gen != topic_gen) {
+
+        if ((n = topic_split(topic, copy, levels)) < 0) return NULL;
+
+        free(hit->topic);
+        free_node_list(hit->subs);
+        hit->code  = code;
+        hit->topic = strdup(topic);
+        hit->gen   = topic_gen;
+        hit->subs  = NULL;
+
+        topic_match(topic_root.child, levels, n, 0, &names);
+        for (name = names; name != NULL; name = name->next) {
+            eff  = lookup_effect(hashtable, name->effect);
+            node = eff ? copy_node(eff) : new_node(name->effect, 0, NULL);
+            node->next = hit->subs;
+            hit->subs  = node;
+        }
+        free_node_list(names);
+        hit->c_mod = hashtable->modified;
+    }
+
+    // who's on which socket may have changed - as update_collection()
+    if (hit->c_mod != hashtable->modified) {
+        for (node = hit->subs; node != NULL; node = node->next)
+            if ((eff = lookup_effect(hashtable, node->effect)) != NULL) {
+                node->socket_num  = eff->socket_num;
+                node->do_not_send = eff->do_not_send;
+            }
+        hit->c_mod = hashtable->modified;
+    }
+
+    return hit;
+}
+
+
+
+/* add the subscribers of every pattern under node matching levels[depth...] to names */
+void topic_match(topic_t *node, char **levels, int n, int depth, list_t **names) {
+
+    list_t *sub, *name;
+
+    for (; node != NULL; node = node->sibling) {
+
+        list_t *subs = NULL;
+
+        if (strcmp(node->level, "#") == 0)
+            subs = node->subs;
+        else if (depth < n && (strcmp(node->level, "*") == 0 || strcmp(node->level, levels[depth]) == 0)) {
+            if (depth+1 == n) subs = node->subs;
+            topic_match(node->child, levels, n, depth+1, names);
+        }
+
+        for (sub = subs; sub != NULL; sub = sub->next) {
+            if (!not_on_list(*names, sub)) continue;
+            name       = new_node(sub->effect, 0, NULL);
+            name->next = *names;
+            *names     = name;
+        }
+    }
+}
+
+
+
+/* split a topic (copied to buf) into levels - how many, or -1 if it's too long or empty */
+int topic_split(char *topic, char *buf, char **levels) {
+
+    char *level, *save;
+    int   n = 0;
+
+    if (topic == NULL || strlen(topic) >= TOPIC_LEN) return -1;
+    strcpy(buf, topic);
+
+    for (level = strtok_r(buf, "/", &save); level != NULL; level = strtok_r(NULL, "/", &save)) {
+        if (n == TOPIC_LEVELS) return -1;
+        levels[n++] = level;
+    }
+
+    return n ? n : -1;
+}
+
+
+
+/* effect:*:SU:<topic>[,<topic>...] - subscribe to each */
+void subscribe(char *effect, char *topics) {
+
+    char  list[BUFLEN], *topic, *save;
+
+    if (effect == NULL || topics == NULL) return;
+    snprintf(list, sizeof(list), "%s", topics);
+
+    for (topic = strtok_r(list, COMMA, &save); topic != NULL; topic = strtok_r(NULL, COMMA, &save))
+        topic_add(effect, topic);
+}
+
+
+
+/* effect:*:UN:<topic>[,<topic>...] - unsubscribe from each (or, with no topics, from everything) */
+void unsubscribe(char *effect, char *topics) {
+
+    char  list[BUFLEN], copy[TOPIC_LEN], *levels[TOPIC_LEVELS], *topic, *save;
+    int   n;
+
+    if (effect == NULL) return;
+
+    if (topics == NULL) {
+        topic_remove(topic_root.child, effect, NULL, -1, 0);
+        topic_gen++;
+        return;
+    }
+
+    snprintf(list, sizeof(list), "%s", topics);
+    for (topic = strtok_r(list, COMMA, &save); topic != NULL; topic = strtok_r(NULL, COMMA, &save))
+        if ((n = topic_split(topic, copy, levels)) > 0)
+            topic_remove(topic_root.child, effect, levels, n, 0);
+
+    topic_gen++;
+}
+
+
+
+/* subscribe effect to one pattern - its levels are added to the trie as needed */
+void topic_add(char *effect, char *topic) {
+
+    char     copy[TOPIC_LEN], *levels[TOPIC_LEVELS];
+    topic_t *parent = &topic_root, *node;
+    list_t   me, *sub;
+    int      i, n;
+
+    if ((n = topic_split(topic, copy, levels)) < 0) return;
+
+    for (i = 0; i < n; i++) {
+        for (node = parent->child; node != NULL && strcmp(node->level, levels[i]) != 0; node = node->sibling)
+            ;
+        if (node == NULL) {
+            if ((node = calloc(1, sizeof(topic_t))) == NULL) return;
+            node->level   = strdup(levels[i]);
+            node->sibling = parent->child;
+            parent->child = node;
+        }
+        parent = node;
+    }
+
+    me.effect = effect;
+    if (!not_on_list(parent->subs, &me)) return;
+
+    sub          = new_node(effect, 0, NULL);
+    sub->next    = parent->subs;
+    parent->subs = sub;
+    topic_gen++;
+}
+
+
+
+/*
+    take effect off the pattern levels[depth...] under node - or off every
+    pattern, if levels is NULL.  Returns how many it was taken off.
+*/
+int topic_remove(topic_t *node, char *effect, char **levels, int n, int depth) {
+
+    list_t **sub, *gone;
+    int      removed = 0;
+
+    for (; node != NULL; node = node->sibling) {
+
+        if (levels != NULL && strcmp(node->level, levels[depth]) != 0) continue;
+
+        if (levels == NULL || depth+1 == n) {
+            for (sub = &node->subs; *sub != NULL; ) {
+                if (strcmp((*sub)->effect, effect) == 0) {
+                    gone = *sub;
+                    *sub = gone->next;
+                    gone->next = NULL;
+                    free_node(gone);
+                    removed++;
+                } else
+                    sub = &(*sub)->next;
+            }
+        }
+
+        if (levels == NULL || depth+1 < n)
+            removed += topic_remove(node->child, effect, levels, n, depth+1);
+    }
+
+    return removed;
+}
+
+
+
+/* (registry snapshot) a 'T effect pattern' line for every subscription under node */
+void topic_snap(topic_t *node, char *prefix, sb_t *sb) {
+
+    char    path[TOPIC_LEN];
+    list_t *sub;
+
+    for (; node != NULL; node = node->sibling) {
+        snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "", node->level);
+        for (sub = node->subs; sub != NULL; sub = sub->next)
+            sb_printf(sb, "T\t%s\t%s\n", sub->effect, path);
+        topic_snap(node->child, path, sb);
+    }
+}
+
+
+
+
+
+
+
+
+/* IDLE CONNECTION ROUTINES  */
+
+/*
+    Every socket has a deadline - IDLE_SECS past its last read - and sits
+    on the wheel slot for that tick.  Reads only update last_seen, so the
+    wheel is often early;  when a slot comes due, each socket on it is
+    either really idle, and closed, or put back for its new deadline.  So
+    a busy effect costs one store a read, and a wheel pass looks only at
+    the slot(s) now due - never at all the sockets.
+
+    Closing goes through closeSK(), which sets the effect's socket to 0
+    and marks the table modified, so collections drop it the next time
+    they're used:  at most IDLE_SECS + WHEEL_TICK_MS after it went quiet.
+*/
+
+
+/* put fd on the wheel, to be looked at when deadline (millis()) comes */
+void wheel_add(int fd, long deadline) {
+
+    long tick = deadline / WHEEL_TICK_MS;
+    int  slot;
+
+    if (tick <= wheel_at) tick = wheel_at+1;           // never the slot wheel_tick() may be emptying
+    slot = tick & (WHEEL_SLOTS-1);
+
+    conns[fd].wheel_slot = slot;
+    conns[fd].wheel_prev = 0;
+    conns[fd].wheel_next = wheel[slot];
+    if (wheel[slot]) conns[wheel[slot]-1].wheel_prev = fd+1;
+    wheel[slot] = fd+1;
+}
+
+
+
+/* take fd off the wheel, if it's on it */
+void wheel_remove(int fd) {
+
+    conn_t *conn = &conns[fd];
+
+    if (conn->wheel_slot < 0) return;
+
+    if (conn->wheel_prev) conns[conn->wheel_prev-1].wheel_next = conn->wheel_next;
+    else                  wheel[conn->wheel_slot]            = conn->wheel_next;
+    if (conn->wheel_next) conns[conn->wheel_next-1].wheel_prev = conn->wheel_prev;
+
+    conn->wheel_slot = -1;
+    conn->wheel_next = conn->wheel_prev = 0;
+}
+
+
+
+/* each pass of the main loop - close whatever's been quiet too long */
+void wheel_tick(fd_set *open_sockets, hash_table_t *hashtable) {
+
+    long now  = millis();
+    long tick = now / WHEEL_TICK_MS;
+
+    for (; wheel_at <= tick; wheel_at++) {
+
+        int slot = wheel_at & (WHEEL_SLOTS-1);
+
+        while (wheel[slot]) {
+
+            int   fd    = wheel[slot]-1;
+            long  quiet = now - conns[fd].last_seen;
+
+            wheel_remove(fd);
+
+            if (!FD_ISSET(fd, open_sockets) || conns[fd].kind != CONN_EFFECT || !IDLE_SECS)
+                continue;
+
+            if (quiet < IDLE_SECS*1000L) {
+                wheel_add(fd, conns[fd].last_seen + IDLE_SECS*1000L);
+                continue;
+            }
+
+            list_t *effect = lookup_effect_sk(hashtable, fd);
+
+            LOG(LV_INFO, "x\tclosing socket:%d (%s), quiet for %lds\n",
+                fd, effect ? effect->effect : "unnamed", quiet/1000L);
+            flight_note(FL_EVICT, fd, (int)(quiet/1000L), effect ? effect->effect : "");
+            if (capture_file) capture_frame(CAP_CLOSE, fd, "", 0);
+            STAT_ADD(stats.evictions, 1);
+
+            closeSK(fd, open_sockets, hashtable);
+        }
+    }
+}
+
+
+
+
+
+/* LATENCY ROUTINES  */
+
+/*
+    The README says ~100us from message in to first message out.  These
+    keep us honest:  every message handled is timed from read() to
+    dispatch, and from dispatch to the first and last send() it caused,
+    by class (button, control, collection forward, scheduled event).
+
+    Sends happen at the end of the pass (flush_output()), so each message
+    handled in a pass gets a slot in lat[], and each socket's pending
+    output carries a bitmask of the slots that contributed to it.  When
+    that output is sent, the slots on its mask get the send time.
+
+    'effect:*:LT' answers with percentiles, 'effect:*:LT:0' also clears.
+*/
+
+
+/* record a value (microseconds) in a histogram */
+void hdr_record(hdr_t *h, long value) {
+
+    int index;
+
+    if (value < 0) value = 0;
+
+    if (value < (1L << HDR_SUB_BITS)) {
+        index = (int)value;
+    } else {
+        int shift = (63 - __builtin_clzll((unsigned long long)value)) - (HDR_SUB_BITS-1);
+        index = shift*(1 << (HDR_SUB_BITS-1)) + (int)(value >> shift);
+        if (index >= HDR_BUCKETS) index = HDR_BUCKETS-1;
+    }
+
+    h->buckets[index]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+
+
+/* largest value that lands in a given bucket */
+long hdr_top(int index) {
+
+    if (index < (1 << HDR_SUB_BITS)) return index;
+
+    int shift = index/(1 << (HDR_SUB_BITS-1)) - 1;
+    return (((long)(index - shift*(1 << (HDR_SUB_BITS-1))) + 1) << shift) - 1;
+}
+
+
+
+/* value at a given percentile (0-100), as the top of its bucket */
+long hdr_percentile(hdr_t *h, double percentile) {
+
+    long target, seen = 0;
+    int  i;
+
+    if (!h->count) return 0;
+
+    target = (long)(percentile/100.0 * h->count + 0.5);
+    if (target < 1) target = 1;
+
+    for (i=0; i<HDR_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            long top = hdr_top(i);
+            return (top < h->max) ? top : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+
+
+/* a message (of a class) is being handled - 'since' is when it was read, or due */
+void lat_begin(int class, long long since) {
+
+    long long now = micros();
+
+    hdr_record(&latency[class][LAT_READ], (long)(now - since));
+
+    if (num_lat >= LAT_SLOTS) { lat_cur = -1; return; }
+
+    lat_cur = num_lat++;
+    lat[lat_cur].class      = class;
+    lat[lat_cur].dispatched = now;
+    lat[lat_cur].first      = 0;
+}
+
+
+
+/* done handling it - anything queued from here on isn't its doing */
+void lat_end(void) {
+    lat_cur = -1;
+}
+
+
+
+/* output for the messages on 'mask' just went out */
+void lat_sent(unsigned long long mask) {
+
+    long long now = micros();
+
+    while (mask) {
+        int i = __builtin_ctzll(mask);
+        if (!lat[i].first) lat[i].first = now;
+        lat[i].last = now;
+        mask &= mask - 1;
+    }
+}
+
+
+
+/* end of the pass - record send times for everything handled in it */
+void lat_record(void) {
+
+    int i;
+
+    for (i=0; i<num_lat; i++) {
+        if (!lat[i].first) continue;     // nothing sent (DS set, no one listening...)
+        hdr_record(&latency[lat[i].class][LAT_FIRST], (long)(lat[i].first - lat[i].dispatched));
+        hdr_record(&latency[lat[i].class][LAT_LAST],  (long)(lat[i].last  - lat[i].dispatched));
+    }
+
+    num_lat = 0;
+    lat_cur = -1;
+}
+
+
+
+/* 'effect:*:LT[:0]' - answer with percentiles in microseconds, optionally clear */
+void report_latency(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    int   c, m;
+
+    // a row per class and metric, then realtime, estop and resume - each at most a few longs wide
+    int   size = 160 * (LAT_CLASSES*LAT_METRICS + 4);
+    char *out  = malloc(size);
+    int   len  = 0;
+
+    if (out == NULL) return;
+
+    len += snprintf(out+len, size-len, "latency (us)                      count    p50    p90    p99  p99.9    max\n");
+
+    for (c=0; c<LAT_CLASSES; c++) {
+        for (m=0; m<LAT_METRICS; m++) {
+            hdr_t *h = &latency[c][m];
+            if (!h->count) continue;
+            len += snprintf(out+len, size-len, "%-10s %-15s %10ld %6ld %6ld %6ld %6ld %6ld\n",
+                       lat_class[c], lat_metric[m], h->count,
+                       hdr_percentile(h,50.0), hdr_percentile(h,90.0), hdr_percentile(h,99.0),
+                       hdr_percentile(h,99.9), h->max);
+        }
+    }
+
+    if (rt_late.count)
+        len += snprintf(out+len, size-len, "%-10s %-15s %10ld %6ld %6ld %6ld %6ld %6ld\n",
+                   "realtime", "wake late", rt_late.count,
+                   hdr_percentile(&rt_late,50.0), hdr_percentile(&rt_late,90.0), hdr_percentile(&rt_late,99.0),
+                   hdr_percentile(&rt_late,99.9), rt_late.max);
+
+    if (estop_lat.count)
+        len += snprintf(out+len, size-len, "%-10s %-15s %10ld %6ld %6ld %6ld %6ld %6ld\n",
+                   "estop", "trigger>last", estop_lat.count,
+                   hdr_percentile(&estop_lat,50.0), hdr_percentile(&estop_lat,90.0), hdr_percentile(&estop_lat,99.0),
+                   hdr_percentile(&estop_lat,99.9), estop_lat.max);
+
+    if (resume_lat.count)
+        len += snprintf(out+len, size-len, "%-10s %-15s %10ld %6ld %6ld %6ld %6ld %6ld\n",
+                   "resume", "rejoin>first", resume_lat.count,
+                   hdr_percentile(&resume_lat,50.0), hdr_percentile(&resume_lat,90.0), hdr_percentile(&resume_lat,99.0),
+                   hdr_percentile(&resume_lat,99.9), resume_lat.max);
+
+    reply_msg(my_msg, open_sockets, out, hashtable);
+    free(out);
+
+    if (my_msg->thirdMsg && strcmp(my_msg->thirdMsg,"0")==0) {
+        memset(latency, 0, sizeof(latency));
+        memset(&rt_late, 0, sizeof(rt_late));
+        memset(&estop_lat, 0, sizeof(estop_lat));
+        memset(&resume_lat, 0, sizeof(resume_lat));
+    }
+}
+
+
+
+
+/* STATS ROUTINES  */
+
+
+/* once a second, work out messages in and out per second */
+void stats_tick(void) {
+
+    long now = millis();
+
+    if (now - last_tick < 1000L) return;
+
+    STAT_SET(stats.in_rate,  (stats.msgs_in  - last_in)  * 1000L / (now - last_tick));
+    STAT_SET(stats.out_rate, (stats.msgs_out - last_out) * 1000L / (now - last_tick));
+
+    last_in   = stats.msgs_in;
+    last_out  = stats.msgs_out;
+    last_tick = now;
+}
+
+
+
+/* 'effect:*:ST' - answer with a compact snapshot of what we're doing */
+void report_stats(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    int      i, online = 0;
+    long     queued    = 0L;
+    list_t  *effect;
+
+    for (i=0; i<num_dirty; i++)
+        queued += conns[dirty[i]].out_len;
+
+    for (i=0; i<hashtable->size; i++)
+        for (effect = hashtable->table[i]; effect != NULL; effect = effect->next)
+            if (effect->socket_num) online++;
+
+    int   size = 512 + 96*hash_table_count(hashtable);
+    char *out  = malloc(size);
+    int   len  = 0;
+
+    if (out == NULL) return;
+
+    len += snprintf(out+len, size-len,
+        "up:%lds conns:%ld accepts:%ld effects:%d online:%d\n"
+        "in:%ld/s out:%ld/s  msgs in:%ld out:%ld sends:%ld  bytes in:%ld out:%ld\n"
+        "queued:%ldB acks pending:%d sched backlog:%ld drops:%ld dups:%ld idle closed:%ld resumed:%ld coalesced:%ld suppressed:%ld\n"
+        "effect           sock     in    out  bytes out  drops   srtt  loss\n",
+        millis()/1000L, STAT_GET(stats.conns), STAT_GET(stats.accepts), hash_table_count(hashtable), online,
+        STAT_GET(stats.in_rate), STAT_GET(stats.out_rate), STAT_GET(stats.msgs_in), STAT_GET(stats.msgs_out),
+        STAT_GET(stats.sends), STAT_GET(stats.bytes_in), STAT_GET(stats.bytes_out),
+        queued, num_pending, STAT_GET(stats.sched_backlog), STAT_GET(stats.drops), STAT_GET(stats.dups),
+        STAT_GET(stats.evictions), STAT_GET(stats.resumes), STAT_GET(stats.coalesced),
+        STAT_GET(stats.suppressed));
+
+    for (i=0; i<hashtable->size; i++) {
+        for (effect = hashtable->table[i]; effect != NULL; effect = effect->next) {
+            conn_t *conn = &conns[effect->socket_num];
+            if (effect->socket_num)
+                len += snprintf(out+len, size-len, "%-16.16s %4d %6ld %6ld %10ld %6ld %6ld %5d\n",
+                           effect->effect, effect->socket_num, conn->msgs_in, conn->msgs_out,
+                           conn->bytes_out, conn->drops, effect->srtt, effect->loss);
+            else
+                len += snprintf(out+len, size-len, "%-16.16s  off\n", effect->effect);
+        }
+    }
+
+    reply_msg(my_msg, open_sockets, out, hashtable);
+    free(out);
+}
+
+
+
+
+/* EMERGENCY STOP ROUTINES  */
+
+/*
+    If the main loop is stuck - a read() that blocks, a huge sequence
+    being built, a pathological collection - KILL_ALL can't get out.
+    So the emergency stop doesn't use the main loop at all.  Its thread
+    (SCHED_FIFO above the main loop, if we're allowed) waits on its own
+    UDP socket and a self-pipe from SIGUSR1, and watches the main loop's
+    heartbeat.  Any of:
+
+        echo XX | nc -u -w0 carnival 5062
+        kill -USR1 <pid>
+        no heartbeat for ESTOP_STALL_MS
+
+    and it sends KILL_ALL straight down its own dup of every armed
+    socket - those that would get KILL_ALL from the main loop, ie
+    registered and not DS.  The dups are armed by the main loop as
+    effects register, and released to the thread to close when they
+    go, so reading estop_fd[] needs no lock.
+
+    A kill can land between two halves of a send the main loop split,
+    garbling that one message - in an emergency, we'll take it.
+
+    The thread can't use LOG() (one producer - the main loop) or the
+    flight recorder (one writer), so it prints directly when debugging.
+*/
+
+
+/* start the thread, with its socket and pipe */
+void estop_start() {
+
+    struct rlimit rl;
+
+    // dups go above FD_SETSIZE, so they don't use up what select() can watch
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 2*FD_SETSIZE + 64) {
+        rl.rlim_cur = (rl.rlim_max < 2*FD_SETSIZE + 64) ? rl.rlim_max : 2*FD_SETSIZE + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (pipe(estop_pipe) < 0) return;
+    fcntl(estop_pipe[1], F_SETFL, O_NONBLOCK);
+    signal(SIGUSR1, estop_signal);
+
+    if (ESTOP_UDP < 0)
+        ESTOP_UDP = ESTOP_PORT;
+
+    estop_on = 1;
+    if (pthread_create(&estop_tid, NULL, estop_thread, NULL) != 0) {
+        estop_on = 0;
+        LOG(LV_ERROR, "xx  no emergency stop thread\n");
+    }
+}
+
+
+
+/* arm (or disarm) the emergency stop for a socket */
+void estop_set(int fd, int on) {
+
+    if (!estop_on || fd < 0 || fd >= FD_SETSIZE) return;
+
+    if (on && !estop_fd[fd]) {
+
+        int d = fcntl(fd, F_DUPFD, FD_SETSIZE);
+        if (d < 0) { LOG(LV_ERROR, "xx  can't arm emergency stop for socket:%d\n", fd); return; }
+        __atomic_store_n(&estop_fd[fd], d+1, __ATOMIC_RELEASE);
+
+    } else if (!on && estop_fd[fd]) {
+
+        int d = __atomic_exchange_n(&estop_fd[fd], 0, __ATOMIC_ACQ_REL) - 1;
+        if (estop_rel_head - __atomic_load_n(&estop_rel_tail, __ATOMIC_ACQUIRE) < FD_SETSIZE) {
+            estop_release[estop_rel_head % FD_SETSIZE] = d;
+            __atomic_store_n(&estop_rel_head, estop_rel_head+1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+
+
+/* SIGUSR1 - just tell the thread (and when) */
+void estop_signal(int sig) {
+
+    int saved = errno;
+
+    __atomic_store_n(&estop_sig_us, micros(), __ATOMIC_RELAXED);
+    if (write(estop_pipe[1], "k", 1) < 0) { }
+    errno = saved;
+}
+
+
+
+/* the thread itself */
+void *estop_thread() {
+
+    struct sched_param param;
+    struct pollfd      fds[2];
+    int                nfds    = 1;
+    int                stalled = 0;
+    int                busy    = 0;
+    char               buf[64];
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = ESTOP_PRIORITY;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);      // if we may
+
+    fds[0].fd     = estop_pipe[0];
+    fds[0].events = POLLIN;
+
+    while (1) {
+
+        // the UDP port - handed over by the server we replaced (see upgrade_receive()),
+        // or bound here.  if it's taken (that server, on its way out), try again each tick
+        if (nfds == 1 && ESTOP_UDP) {
+            int us = __atomic_load_n(&estop_udp, __ATOMIC_ACQUIRE), none = -1;
+            if (us < 0 && (us = estop_bind()) >= 0 &&
+                !__atomic_compare_exchange_n(&estop_udp, &none, us, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                close(us);
+                us = none;
+            }
+            if (us >= 0) {
+                fds[1].fd     = us;
+                fds[1].events = POLLIN;
+                nfds          = 2;
+                if (DEBUG && busy) { printf("xx  emergency stop: UDP port %d is ours now\n", ESTOP_UDP); fflush(stdout); }
+            } else if (DEBUG && !busy++) {
+                printf("xx  emergency stop: can't bind UDP port %d - trying until we can\n", ESTOP_UDP); fflush(stdout);
+            }
+        }
+
+        int rc = poll(fds, nfds, ESTOP_TICK_MS);
+
+        // close any dups the main loop is done with
+        while (estop_rel_tail < __atomic_load_n(&estop_rel_head, __ATOMIC_ACQUIRE)) {
+            close(estop_release[estop_rel_tail % FD_SETSIZE]);
+            __atomic_store_n(&estop_rel_tail, estop_rel_tail+1, __ATOMIC_RELEASE);
+        }
+
+        if (rc > 0 && (fds[0].revents & POLLIN)) {
+            while (read(estop_pipe[0], buf, sizeof(buf)) == sizeof(buf)) ;
+            estop_fire(__atomic_load_n(&estop_sig_us, __ATOMIC_RELAXED), "signal");
+        }
+
+        if (rc > 0 && nfds > 1 && (fds[1].revents & POLLIN)) {
+            long long since = micros();
+            int n = recv(fds[1].fd, buf, sizeof(buf)-1, 0);
+            if (n >= 2 && buf[0] == 'X' && buf[1] == 'X')
+                estop_fire(since, "udp");
+        }
+
+        long long quiet = micros() - __atomic_load_n(&heartbeat, __ATOMIC_RELAXED);
+        if (ESTOP_STALL_MS && quiet > ESTOP_STALL_MS*1000LL) {
+            if (!stalled) estop_fire(micros(), "main loop stalled");
+            stalled = 1;
+        } else
+            stalled = 0;
+    }
+
+    return NULL;
+}
+
+
+
+/* a UDP socket on ESTOP_UDP, or -1 */
+int estop_bind() {
+
+    struct sockaddr_in sa;
+    int                us = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (us < 0) return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_port        = htons(ESTOP_UDP);
+    sa.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(us, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(us);
+        return -1;
+    }
+    return us;
+}
+
+
+
+/* KILL_ALL to every armed socket, now */
+void estop_fire(long long since, char *why) {
+
+    int fd, d, sent = 0;
+
+    for (fd=0; fd<FD_SETSIZE; fd++) {
+        if ((d = __atomic_load_n(&estop_fd[fd], __ATOMIC_ACQUIRE)) == 0) continue;
+        if (send(d-1, KILL_ALL, strlen(KILL_ALL)+1, MSG_NOSIGNAL | MSG_DONTWAIT) > 0) sent++;
+    }
+
+    __atomic_add_fetch(&estop_gen, 1, __ATOMIC_RELEASE);
+    hdr_record(&estop_lat, micros() - since);
+
+    if (DEBUG) { printf("xx  EMERGENCY STOP (%s) - KILL_ALL to %d effects\n", why, sent); fflush(stdout); }
+}
+
+
+
+
+/* REAL-TIME ROUTINES  */
+
+/*
+    On the Pi we share the cpu with hostapd, dnsmasq and whatever else,
+    and a page fault or a preemption at the wrong moment is a late kill.
+    So with -R:  lock everything we have and will have into memory,
+    touch the stack and a chunk of heap now (and tell malloc to keep
+    it), then run SCHED_FIFO pinned to one core.  Best on a core the
+    kernel leaves alone (isolcpus=3 on the kernel command line, say).
+
+    The main loop then blocks in select() on traffic, for at most
+    RT_TICK_US, instead of napping each pass - and how late each tick
+    wakes is the jitter we get, in rt_late (see LT).
+
+    Anything that fails (not root, say) is logged and we carry on.
+*/
+
+
+/* lock, prefault, prioritize and pin */
+void rt_setup() {
+
+    struct sched_param param;
+    cpu_set_t          cpus;
+    char              *heap;
+    long               page = sysconf(_SC_PAGESIZE);
+    long               i;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        LOG(LV_ERROR, "xx  real-time: mlockall failed: %s\n", strerror(errno));
+
+    // freed memory stays ours (and locked), rather than going back to the system
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    if ((heap = malloc(RT_HEAP_PREFAULT)) != NULL) {
+        for (i=0; i<RT_HEAP_PREFAULT; i+=page)
+            heap[i] = 0;
+        free(heap);
+    }
+    rt_prefault_stack();
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = RT_PRIORITY;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        LOG(LV_ERROR, "xx  real-time: SCHED_FIFO failed: %s\n", strerror(errno));
+
+    if (RT_CORE >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(RT_CORE, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            LOG(LV_ERROR, "xx  real-time: can't pin to core %d: %s\n", RT_CORE, strerror(errno));
+    }
+
+    LOG(LV_INFO, "real-time: SCHED_FIFO %d, core %d, tick %dus\n", RT_PRIORITY, RT_CORE, RT_TICK_US);
+}
+
+
+
+/* touch the stack we'll need, so it's faulted in (and locked) now */
+void rt_prefault_stack() {
+
+    volatile char stack[RT_STACK_PREFAULT];
+    long          i;
+
+    for (i=0; i<RT_STACK_PREFAULT; i+=1024)
+        stack[i] = 0;
+    (void)stack[0];
+}
+
+
+
+
+/* LOGGING ROUTINES  */
+
+/*
+    printf() and fflush() on every message, in the main loop, distorts
+    exactly the timing we turn DEBUG on to look at.  So LOG() doesn't
+    format anything:  log_push() copies the format pointer and arguments
+    (and any strings - they won't be there later) into a record on a
+    single producer / single consumer ring, and a writer thread formats
+    and writes them, flushing once per batch.  If the writer falls
+    LOG_SLOTS behind, records are dropped and counted, never waited for.
+*/
+
+
+/* start the writer thread */
+void log_start() {
+
+    log_running = 1;
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        log_running = 0;
+        printf("no log writer - logging off\n"); fflush(stdout);
+        DEBUG = 0;
+    }
+}
+
+
+
+/* queue a log record - the format's conversions say what the arguments are */
+void log_push(const char *fmt, ...) {
+
+    uint64_t   head = log_head;
+    va_list    ap;
+    const char *f;
+    int        n = 0, used = 0;
+
+    if (head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) >= LOG_SLOTS) {
+        log_dropped++;
+        return;
+    }
+
+    log_rec_t *rec = &log_ring[head % LOG_SLOTS];
+    rec->t_us = micros();
+    rec->fmt  = fmt;
+
+    va_start(ap, fmt);
+    for (f = fmt; *f && n < LOG_ARGS; f++) {
+
+        if (*f != '%') continue;
+        if (*++f == '%') continue;
+
+        int longs = 0;
+        while (*f && strchr("-+ #0123456789.", *f)) f++;
+        while (*f == 'l') { longs++; f++; }
+        while (*f == 'h') f++;
+
+        switch (*f) {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'c':
+                if (longs == 2)    { rec->kinds[n] = 'L'; rec->args[n].i = va_arg(ap, long long); }
+                else if (longs)    { rec->kinds[n] = 'l'; rec->args[n].i = va_arg(ap, long); }
+                else               { rec->kinds[n] = 'i'; rec->args[n].i = va_arg(ap, int); }
+                break;
+            case 'f': case 'g': case 'e':
+                rec->kinds[n] = 'd'; rec->args[n].d = va_arg(ap, double);
+                break;
+            case 'p':
+                rec->kinds[n] = 'p'; rec->args[n].p = va_arg(ap, void *);
+                break;
+            case 's': {
+                const char *str = va_arg(ap, const char *);
+                if (str == NULL) str = "(null)";
+                rec->kinds[n]  = 's';
+                if (used >= LOG_STRLEN) {               // full - it gets the last string's null, ""
+                    rec->args[n].s = LOG_STRLEN-1;
+                    break;
+                }
+                rec->args[n].s = used;
+                while (*str && used < LOG_STRLEN-1) rec->str[used++] = *str++;
+                if (used < LOG_STRLEN) rec->str[used++] = '\0';
+                else rec->str[LOG_STRLEN-1] = '\0';
+                break;
+            }
+            default:
+                rec->kinds[n] = 'i'; rec->args[n].i = 0;
+        }
+        n++;
+        if (!*f) break;
+    }
+    va_end(ap);
+
+    rec->nargs = n;
+    __atomic_store_n(&log_head, head+1, __ATOMIC_RELEASE);
+}
+
+
+
+/* the writer thread:  write whatever's there, flush, nap if there was nothing */
+void *log_writer() {
+
+    long dropped = 0L;
+
+    while (log_running) {
+
+        if (!log_drain()) {
+            delay(LOG_IDLE_MS);
+            continue;
+        }
+
+        if (log_dropped != dropped) {
+            printf("xx  %ld log records dropped - writer couldn't keep up\n", log_dropped - dropped);
+            dropped = log_dropped;
+        }
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+
+
+/* write out every record queued so far, returning how many there were */
+int log_drain() {
+
+    uint64_t tail = log_tail;
+    uint64_t head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+    int      n    = 0;
+
+    for (; tail < head; tail++, n++) {
+        log_format(&log_ring[tail % LOG_SLOTS]);
+        __atomic_store_n(&log_tail, tail+1, __ATOMIC_RELEASE);
+    }
+
+    return n;
+}
+
+
+
+/* print one record, putting its arguments back into its format one conversion at a time */
+void log_format(log_rec_t *rec) {
+
+    const char *f = rec->fmt;
+    char        spec[16];
+    int         n = 0;
+
+    printf("%lld  ", rec->t_us/1000);               // the time, in ms, as cur_time() used to
+
+    while (*f) {
+
+        if (*f != '%') { putchar(*f++); continue; }
+        if (f[1] == '%') { putchar('%'); f += 2; continue; }
+
+        // the whole conversion, eg %-10ld
+        int len = 1;
+        while (f[len] && !strchr("diuxXcfgeps", f[len]) && len < (int)sizeof(spec)-2) len++;
+        memcpy(spec, f, len+1);
+        spec[len+1] = '\0';
+        f += f[len] ? len+1 : len;
+
+        if (n >= rec->nargs) { fputs(spec, stdout); continue; }
+
+        switch (rec->kinds[n]) {
+            case 'i': printf(spec, (int)rec->args[n].i);       break;
+            case 'l': printf(spec, (long)rec->args[n].i);      break;
+            case 'L': printf(spec, rec->args[n].i);            break;
+            case 'd': printf(spec, rec->args[n].d);            break;
+            case 'p': printf(spec, rec->args[n].p);            break;
+            case 's': printf(spec, rec->str + rec->args[n].s); break;
+        }
+        n++;
+    }
+}
+
+
+
+/* write out anything still queued, and stop the writer */
+void log_flush() {
+
+    if (!log_running) return;
+
+    log_running = 0;
+    pthread_join(log_thread, NULL);
+    log_drain();
+    fflush(stdout);
+}
+
+
+
+
+/* FLIGHT RECORDER ROUTINES  */
+
+/*
+    DEBUG is all or nothing, and as a daemon we have nothing.  So the
+    flight recorder is always on:  a ring of small fixed records in a
+    memory mapped file, written with a few stores each - no printf, no
+    syscall, nothing to flush.  The kernel keeps the pages, so if we
+    crash, the last FLIGHT_SLOTS things we did are still in the file.
+
+    There's one writer (us).  Each record's seq is zeroed while it's
+    written, and set last, so a reader (xc-flight.c) can skip any it
+    catches halfway.  Restarts carry on in the same ring, after a
+    FL_START, so the history before a crash survives the restart.
+*/
+
+
+/* open (or create) a file in a shared directory that only we may read - it
+   can hold tokens.  Not through a link someone left there, nor one of theirs */
+int private_open(char *path) {
+
+    struct stat st;
+    int         fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || fchmod(fd, 0600) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+
+/* map the flight recorder file, (re)using it if it's one of ours */
+void flight_open(char *path) {
+
+    struct timespec spec;
+    size_t          size = sizeof(flight_hdr_t) + FLIGHT_SLOTS*sizeof(flight_rec_t);
+    int             fd   = private_open(path);
+
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        if (DEBUG) { printf("no flight recorder - can't open %s\n", path); fflush(stdout); }
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    flight      = (flight_hdr_t *)map;
+    flight_recs = (flight_rec_t *)(flight + 1);
+
+    if (memcmp(flight->magic, FLIGHT_MAGIC, 8) != 0 || flight->slots != FLIGHT_SLOTS ||
+        flight->rec_size != sizeof(flight_rec_t)) {
+        memset(map, 0, size);
+        memcpy(flight->magic, FLIGHT_MAGIC, 8);
+        flight->slots    = FLIGHT_SLOTS;
+        flight->rec_size = sizeof(flight_rec_t);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &spec);
+    flight_epoch = spec.tv_sec*1000000LL + spec.tv_nsec/1000 - micros();
+
+    flight_note(FL_START, 0, (int)getpid(), "");
+}
+
+
+
+/* record one thing that happened */
+void flight_note(int type, int fd, int arg, const char *text) {
+
+    if (!flight) return;
+
+    uint64_t      n   = flight->head;
+    flight_rec_t *rec = &flight_recs[n % FLIGHT_SLOTS];
+    int           i;
+
+    // seq 0 (torn) must be seen before any of the new record - the store alone doesn't order
+    // what comes after it, so fence (xc-flight reads seq, the record, fences, then seq again)
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec->t_us = flight_epoch + micros();
+    rec->type = type;
+    rec->fd   = fd;
+    rec->arg  = arg;
+    for (i=0; i<FLIGHT_TEXT-1 && text[i]; i++)
+        rec->text[i] = text[i];
+    rec->text[i] = '\0';
+
+    __atomic_store_n(&rec->seq, n+1, __ATOMIC_RELEASE);
+    __atomic_store_n(&flight->head, n+1, __ATOMIC_RELEASE);
+}
+
+
+
+
+/* SNAPSHOT ROUTINES  */
+
+/*
+    The registry - every effect with its ip, DS, acks and token, every
+    collection and subscription, and the round order - as text, a line each:
+
+        E <effect> <ip> <ds> <acks> <token>
+        C <effect> <effect1>,<effect2>...
+        T <effect> <topic pattern it subscribes to>
+        O <effect1>,<effect2>...
+
+    (tab separated), kept in a memory mapped file.  Once every SNAP_EVERY_MS
+    it's rebuilt, and if it's changed, written to the copy that isn't current,
+    which is then made current.  A few dozen effects make a few kilobytes,
+    and nothing's written at all while the show's running as set up.
+
+    At startup, it's loaded through the same routines the messages use
+    (add_effect(), set_collection(), set_list_order()), with no sockets -
+    each effect takes up its old place when it next says something.
+*/
+
+
+/* map the snapshot file, starting it afresh if it isn't one */
+void snap_open(char *path) {
+
+    size_t size = sizeof(snap_hdr_t) + 2*SNAP_HALF;
+    int    fd   = private_open(path);
+
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        if (DEBUG) { printf("no registry snapshot - can't open %s\n", path); fflush(stdout); }
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    snap = (snap_hdr_t *)map;
+
+    if (memcmp(snap->magic, SNAP_MAGIC, 8) != 0 || snap->half != SNAP_HALF ||
+        snap->current > 1 || snap->len[snap->current] > SNAP_HALF) {
+        memset(snap, 0, sizeof(snap_hdr_t));
+        memcpy(snap->magic, SNAP_MAGIC, 8);
+        snap->half = SNAP_HALF;
+    }
+}
+
+
+
+/* at startup - load the current snapshot, if any */
+void snap_restore(hash_table_t *hashtable) {
+
+    if (!snap || !snap->len[snap->current]) return;
+
+    int n = snap_load(hashtable, (char *)(snap+1) + snap->current*SNAP_HALF, snap->len[snap->current], NULL, 0);
+
+    if (DEBUG) { printf("restored %d effects from snapshot #%llu\n", n, (unsigned long long)snap->seq); fflush(stdout); }
+}
+
+
+
+/* each pass of the main loop - save the registry, if it's time, and it's changed */
+void snap_tick(hash_table_t *hashtable) {
+
+    long  now = millis();
+    int   cur, next;
+    char *copy;
+
+    if (!snap || now - snap_last < SNAP_EVERY_MS) return;
+    snap_last = now;
+
+    snap_build(hashtable, &snap_sb);
+
+    cur  = snap->current;
+    next = 1 - cur;
+    copy = (char *)(snap+1);
+
+    if (snap_sb.len == (int)snap->len[cur] && memcmp(copy + cur*SNAP_HALF, snap_sb.data, snap_sb.len) == 0)
+        return;
+
+    if (snap_sb.len > SNAP_HALF) {
+        LOG(LV_ERROR, "xx  registry snapshot too big (%d bytes), not saved\n", snap_sb.len);
+        return;
+    }
+
+    memcpy(copy + next*SNAP_HALF, snap_sb.data, snap_sb.len);
+    snap->len[next] = snap_sb.len;
+    snap->seq++;
+    __atomic_store_n(&snap->current, next, __ATOMIC_RELEASE);
+
+    msync(snap, sizeof(snap_hdr_t) + 2*SNAP_HALF, MS_ASYNC);
+}
+
+
+
+/* the registry, as text, into sb (emptied first) */
+void snap_build(hash_table_t *hashtable, sb_t *sb) {
+
+    int     i;
+    list_t *effect, *member;
+    char    chans[4*CHAN_MAX];
+
+    sb->len = 0;
+    sb_printf(sb, "");                  // so sb->data exists, even for an empty table
+
+    for (i=0; i<hashtable->size; i++)
+        for (effect = hashtable->table[i]; effect != NULL; effect = effect->next)
+            sb_printf(sb, "E\t%s\t%s\t%d\t%d\t%016llx\n", effect->effect,
+                      (effect->ipadd && *effect->ipadd) ? effect->ipadd : "-",
+                      effect->do_not_send, effect->acks, effect->token);
+
+    for (i=0; i<hashtable->size; i++) {
+        for (effect = hashtable->table[i]; effect != NULL; effect = effect->next) {
+            if (!effect->collection) continue;
+            sb_printf(sb, "C\t%s\t", effect->effect);
+            for (member = effect->collection; member != NULL; member = member->next) {
+                chan_format(member, chans, sizeof(chans));
+                sb_printf(sb, member->next ? "%s%s," : "%s%s\n", member->effect, chans);
+            }
+        }
+    }
+
+    topic_snap(topic_root.child, "", sb);
+
+    if (hashtable->ordered) {
+        sb_printf(sb, "O\t");
+        for (member = hashtable->ordered; member != NULL; member = member->next) {
+            chan_format(member, chans, sizeof(chans));
+            sb_printf(sb, member->next ? "%s%s," : "%s%s\n", member->effect, chans);
+        }
+    }
+}
+
+
+
+/*
+    load a registry built by snap_build() - returns the effects added.
+    Handed over by an upgrade, there are also sockets, fds, and lines
+
+        S <effect> <index in fds>
+
+    putting the effects back on them.
+*/
+int snap_load(hash_table_t *hashtable, char *data, int len, int *fds, int nfds) {
+
+    char   *text = malloc(len+1);
+    char   *line, *next_line, *f[6];
+    int     n = 0, i;
+    msg_t   msg;
+    list_t *effect;
+
+    if (text == NULL) return 0;
+    memcpy(text, data, len);
+    text[len] = '\0';
+
+    for (line = strtok_r(text, "\n", &next_line); line != NULL; line = strtok_r(NULL, "\n", &next_line)) {
+
+        // split on tabs
+        for (i=0; i<6; i++) {
+            f[i] = line;
+            if (line && (line = strchr(line, '\t')) != NULL) *line++ = '\0';
+        }
+
+        memset(&msg, 0, sizeof(msg));
+
+        if (strcmp(f[0],"E")==0 && f[5] && !lookup_effect(hashtable, f[1])) {
+            msg.effectName = f[1];
+            msg.ipadd      = strcmp(f[2],"-")==0 ? "" : f[2];
+            if (add_effect(hashtable, &msg) != 0) continue;
+            effect = lookup_effect(hashtable, f[1]);
+            effect->do_not_send = atoi(f[3]);
+            effect->acks        = atoi(f[4]);
+            effect->token       = strtoull(f[5], NULL, 16);
+            eff_sync(effect);
+            n++;
+        } else if (strcmp(f[0],"C")==0 && f[2] && lookup_effect(hashtable, f[1])) {
+            msg.effectName = f[1];
+            msg.thirdMsg   = f[2];
+            set_collection(hashtable, &msg);
+        } else if (strcmp(f[0],"O")==0 && f[1]) {
+            msg.thirdMsg   = f[1];
+            set_list_order(hashtable, &msg);
+        } else if (strcmp(f[0],"T")==0 && f[2]) {
+            subscribe(f[1], f[2]);
+        } else if (strcmp(f[0],"S")==0 && fds && f[2] && (effect = lookup_effect(hashtable, f[1])) != NULL) {
+            i = atoi(f[2]);
+            if (i < 1 || i >= nfds || fds[i] < 0) continue;
+            effect->socket_num   = fds[i];
+            conns[fds[i]].effect = effect;
+            hashtable->modified  = millis();
+            eff_sync(effect);
+            estop_set(fds[i], !effect->do_not_send);
+        }
+    }
+
+    free(text);
+    return n;
+}
+
+
+
+
+
+/* UPGRADE ROUTINES  */
+
+/*
+    Hot upgrade.  We listen on UPGRADE_SOCK (a unix socket, owner only).
+    A new binary started with -U connects, and we pass it - SCM_RIGHTS -
+    the listening socket, the metrics listener, the emergency stop's UDP
+    socket (see estop_thread()), and every effect's socket,
+    then the registry (snap_build(), and which effect's on which socket).
+    Once it says it has them all, we exit.  The connections don't notice:
+    the kernel just has one fewer process holding them.  If anything goes
+    wrong before then, we close our end and carry on as if nothing happened.
+
+    Sequences and acks don't make the trip:  a poof whose PoofOFF was
+    still to come would stay lit, with nobody to turn it off.  So while
+    any sequence is under way, or any critical command is awaiting its
+    ack, the new binary waits (UPGRADE_HOLD_MS at most - then it's
+    refused, and we carry on).  What's lost:  metrics scrapes.
+*/
+
+
+/* listen for a new binary wanting to take over */
+void upgrade_listen(fd_set *open_sockets) {
+
+    struct sockaddr_un sa;
+    int                us = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (us < 0) return;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", UPGRADE_SOCK);
+
+    unlink(UPGRADE_SOCK);
+    if (bind(us, (struct sockaddr *)&sa, sizeof(sa)) || chmod(UPGRADE_SOCK, 0600) || listen(us, 1)) {
+        LOG(LV_ERROR, "xx  can't listen for upgrades on %s\n", UPGRADE_SOCK);
+        close(us);
+        return;
+    }
+    fcntl(us, F_SETFL, O_NONBLOCK);
+
+    upgrade_sock       = us;
+    conns[us].kind     = CONN_UPGRADE_LISTEN;
+    FD_SET(us, open_sockets);
+    if (us > max_socket) max_socket = us;
+}
+
+
+
+/* each pass of the main loop - hand over and exit, if a new binary's asking (and we're idle) */
+void upgrade_check(fd_set *readable_sockets, fd_set *open_sockets, hash_table_t *hashtable, event_t *events) {
+
+    int c;
+
+    if (upgrade_wait < 0) {
+        if (upgrade_sock < 0 || !FD_ISSET(upgrade_sock, readable_sockets)) return;
+        if ((upgrade_wait = accept(upgrade_sock, NULL, NULL)) < 0) return;
+        upgrade_since = millis();
+    }
+
+    // not with a sequence running, or a stop unconfirmed
+    if (events != NULL || num_pending) {
+        if (millis() - upgrade_since < UPGRADE_HOLD_MS) return;
+        LOG(LV_ERROR, "xx  upgrade refused - still busy after %d ms\n", UPGRADE_HOLD_MS);
+        close(upgrade_wait);
+        upgrade_wait = -1;
+        return;
+    }
+
+    c            = upgrade_wait;
+    upgrade_wait = -1;
+
+    fcntl(c, F_SETFL, 0);               // blocking, but never for long - see upgrade_send()
+
+    if (upgrade_send(c, open_sockets, hashtable) == 0) {
+        LOG(LV_INFO, "handed over to the new server - exiting\n");
+        log_flush();
+        exit(0);
+    }
+
+    LOG(LV_ERROR, "xx  upgrade failed, carrying on\n");
+    close(c);
+}
+
+
+
+/*
+    Pass everything to the new binary on c, and wait for it to say it's
+    got it - but no more than UPGRADE_WAIT_MS, all told.  A new binary
+    that hangs (in its snapshot restore, say) mustn't hang us:  we'd stop
+    serving, and ESTOP_STALL_MS later the emergency stop kills the show.
+    Once it has everything we tell it we're going, and it won't serve
+    until we have - so if we give up on it instead, it gives up too.
+*/
+int upgrade_send(int c, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    upgrade_hdr_t  hdr;
+    int            fds[FD_SETSIZE+2], at[FD_SETSIZE];
+    int            n = 0, i, us;
+    list_t        *effect;
+    char           ok;
+    long long      deadline = micros() + UPGRADE_WAIT_MS*1000LL;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, UPGRADE_MAGIC, 8);
+
+    fds[n++] = firstSocket;
+    if (metrics_listen >= 0) {
+        fds[n++]   = metrics_listen;
+        hdr.flags |= UPG_METRICS;
+    }
+    if ((us = __atomic_load_n(&estop_udp, __ATOMIC_ACQUIRE)) >= 0) {
+        fds[n++]   = us;                // so the new binary never runs without it
+        hdr.flags |= UPG_ESTOP;
+    }
+    for (i=firstSocket+1; i<max_socket+1; i++) {
+        if (!FD_ISSET(i, open_sockets) || conns[i].kind != CONN_EFFECT) continue;
+        at[i]    = n;
+        fds[n++] = i;
+    }
+
+    snap_build(hashtable, &snap_sb);
+    for (i=0; i<hashtable->size; i++)
+        for (effect = hashtable->table[i]; effect != NULL; effect = effect->next)
+            if (effect->socket_num && FD_ISSET(effect->socket_num, open_sockets) && conns[effect->socket_num].kind == CONN_EFFECT)
+                sb_printf(&snap_sb, "S\t%s\t%d\n", effect->effect, at[effect->socket_num]);
+
+    hdr.nfds     = n;
+    hdr.text_len = snap_sb.len;
+
+    if (upgrade_timeout(c, deadline) < 0 || upgrade_write(c, &hdr, sizeof(hdr)) < 0) return -1;
+    for (i=0; i<n; i+=UPGRADE_FDS)
+        if (upgrade_timeout(c, deadline) < 0 || upgrade_pass_fds(c, fds+i, (n-i < UPGRADE_FDS) ? n-i : UPGRADE_FDS) < 0) return -1;
+    if (upgrade_timeout(c, deadline) < 0 || upgrade_write(c, snap_sb.data, snap_sb.len) < 0) return -1;
+
+    if (upgrade_timeout(c, deadline) < 0 || read(c, &ok, 1) != 1) return -1;
+    if (upgrade_timeout(c, deadline) < 0 || write(c, "1", 1) != 1) return -1;
+
+    flight_note(FL_UPGRADE, c, n, "handed over");
+    return 0;
+}
+
+
+
+/* -U: take over from the running server.  1 if we did, 0 if there wasn't one (or it failed) */
+int upgrade_receive(fd_set *open_sockets, hash_table_t *hashtable) {
+
+    struct sockaddr_un sa;
+    upgrade_hdr_t      hdr;
+    int                c, i, got = 0, n, effects;
+    int               *fds  = NULL;
+    char              *text = NULL;
+    char               ok;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", UPGRADE_SOCK);
+
+    if ((c = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return 0;
+
+    if (connect(c, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        upgrade_read(c, &hdr, sizeof(hdr)) < 0 ||
+        (memcmp(hdr.magic, UPGRADE_MAGIC, 8) != 0 && memcmp(hdr.magic, UPGRADE_MAGIC_1, 8) != 0) ||
+        hdr.nfds < 1 || hdr.nfds > FD_SETSIZE+2 || hdr.text_len < 0) {
+        if (DEBUG) { printf("no server to take over from, starting afresh\n"); fflush(stdout); }
+        close(c);
+        return 0;
+    }
+
+    fds  = malloc(hdr.nfds*sizeof(int));
+    text = malloc(hdr.text_len+1);
+
+    while (fds && got < hdr.nfds && (n = upgrade_take_fds(c, fds+got, hdr.nfds-got)) > 0)
+        got += n;
+
+    if (!fds || !text || got < hdr.nfds || upgrade_read(c, text, hdr.text_len) < 0) {
+        if (DEBUG) { printf("take over failed, after %d of %d sockets\n", got, hdr.nfds); fflush(stdout); }
+        for (i=0; i<got; i++) close(fds[i]);
+        free(fds);
+        free(text);
+        close(c);
+        return 0;
+    }
+
+    // the listener first - effects are only looked for above it
+    firstSocket = fds[0];
+    listen_options(firstSocket);        // our backlog, and a listener from an older binary may lack them
+    FD_SET(firstSocket, open_sockets);
+    max_socket  = firstSocket;
+
+    i = 1;
+    if (hdr.flags & UPG_METRICS) {
+        if (METRICS_PORT) {
+            metrics_listen = fds[i];
+            conns[fds[i]].kind = CONN_METRICS_LISTEN;
+            FD_SET(fds[i], open_sockets);
+            if (fds[i] > max_socket) max_socket = fds[i];
+        } else
+            close(fds[i]);
+        i++;
+    }
+    if (hdr.flags & UPG_ESTOP) {
+        // the emergency stop's port - if it's the one we want, and the thread's still without one
+        struct sockaddr_in sa;
+        socklen_t          len  = sizeof(sa);
+        int                none = -1;
+        if (!estop_on || getsockname(fds[i], (struct sockaddr *)&sa, &len) < 0 || ntohs(sa.sin_port) != ESTOP_UDP ||
+            !__atomic_compare_exchange_n(&estop_udp, &none, fds[i], 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            close(fds[i]);
+        i++;
+    }
+
+    for (; i<hdr.nfds; i++) {
+        if (fds[i] >= FD_SETSIZE) {
+            close(fds[i]);
+            fds[i] = -1;
+        } else {
+            add_socket(fds[i], open_sockets);
+            getip(fds[i], conns[fds[i]].ip);
+        }
+    }
+
+    effects = snap_load(hashtable, text, hdr.text_len, fds, hdr.nfds);
+
+    // got it all - and the old server's going?  if it gave up on us it's still serving, so we mustn't
+    if (memcmp(hdr.magic, UPGRADE_MAGIC, 8) == 0 &&
+        (write(c, "1", 1) != 1 || upgrade_timeout(c, micros() + 2*UPGRADE_WAIT_MS*1000LL) < 0 ||
+         read(c, &ok, 1) != 1)) {
+        if (DEBUG) { printf("the old server gave up on us - it carries on, we don't\n"); fflush(stdout); }
+        exit(1);
+    }
+    if (memcmp(hdr.magic, UPGRADE_MAGIC_1, 8) == 0 && write(c, "1", 1) != 1) { /* it's gone - but we have everything */ }
+    close(c);
+
+    flight_note(FL_UPGRADE, firstSocket, hdr.nfds, "took over");
+    if (DEBUG) { printf("took over %d sockets and %d effects\n", hdr.nfds, effects); fflush(stdout); }
+
+    free(fds);
+    free(text);
+    return 1;
+}
+
+
+
+/* send n fds over c, in one message */
+int upgrade_pass_fds(int c, int *fds, int n) {
+
+    char            byte = 0;
+    struct iovec    iov  = { &byte, 1 };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(UPGRADE_FDS*sizeof(int))];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = CMSG_SPACE(n*sizeof(int));
+
+    cmsg             = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(n*sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n*sizeof(int));
+
+    return (sendmsg(c, &msg, 0) == 1) ? 0 : -1;
+}
+
+
+
+/* take up to max fds from c - returns how many came */
+int upgrade_take_fds(int c, int *fds, int max) {
+
+    char            byte;
+    struct iovec    iov = { &byte, 1 };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(UPGRADE_FDS*sizeof(int))];
+    } control;
+    int             n = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(c, &msg, 0) != 1) return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > max) n = max;
+        memcpy(fds, CMSG_DATA(cmsg), n*sizeof(int));
+    }
+
+    return n;
+}
+
+
+
+/* all of len bytes, or -1 */
+int upgrade_write(int c, const void *buf, int len) {
+
+    int done = 0, rc;
+
+    while (done < len) {
+        rc = write(c, (const char *)buf + done, len - done);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return -1;
+        done += rc;
+    }
+    return 0;
+}
+
+
+
+/* bound what's left of a handover on c:  reads and writes time out at deadline (micros()) - -1 if it's passed */
+int upgrade_timeout(int c, long long deadline) {
+
+    long long      left = deadline - micros();
+    struct timeval tv;
+
+    if (left <= 0) return -1;
+
+    tv.tv_sec  = left / 1000000;
+    tv.tv_usec = left % 1000000;
+
+    if (setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) return -1;
+    return 0;
+}
+
+
+
+/* all of len bytes, or -1 */
+int upgrade_read(int c, void *buf, int len) {
+
+    int done = 0, rc;
+
+    while (done < len) {
+        rc = read(c, (char *)buf + done, len - done);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return -1;
+        done += rc;
+    }
+    return 0;
+}
+
+
+
+
+
+/* CAPTURE AND REPLAY ROUTINES  */
+
+/*
+    When a show glitches, we want to see it again.  With -c, every frame
+    that comes in goes to a capture file: a fixed header (time, socket,
+    kind, length) and the bytes, through a big stdio buffer, so it costs
+    a memcpy per read.  It's flushed once a second.
+
+    With -r, instead of listening, we make a socketpair for each captured
+    connection, and write the captured reads into them when they're due
+    (or, with -f, one per pass of the main loop, as fast as we can go).
+    The server end goes through exactly the code an effect's socket does -
+    readBuffer(), processMsg(), the scheduler, flush_output().  What comes
+    back out is read off the client ends and hashed, so two runs of the
+    same capture can be compared, along with the usual stats.
+*/
+
+
+/* open the capture file, and say what it is */
+void capture_open(char *path) {
+
+    capture_file = fopen(path, "ab");
+    if (capture_file == NULL) error("capture file");
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUF);
+
+    fseek(capture_file, 0L, SEEK_END);
+    if (ftell(capture_file) == 0)
+        fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_file);
+    fflush(capture_file);       // or a daemon's parent writes it again on exit
+}
+
+
+
+/* append one frame */
+void capture_frame(int kind, int fd, char *data, int len) {
+
+    cap_rec_t rec;
+
+    rec.t_us = micros();
+    rec.fd   = fd;
+    rec.kind = kind;
+    rec.len  = len;
+
+    fwrite(&rec, sizeof(rec), 1, capture_file);
+    if (len) fwrite(data, 1, len, capture_file);
+
+    if (millis() - capture_flushed >= 1000L) {
+        fflush(capture_file);
+        capture_flushed = millis();
+    }
+}
+
+
+
+/* open a capture to replay, and read its first frame */
+void replay_open(char *path) {
+
+    char magic[sizeof(CAPTURE_MAGIC)];
+
+    replay_file = fopen(path, "rb");
+    if (replay_file == NULL) error("replay file");
+
+    if (fread(magic, 1, strlen(CAPTURE_MAGIC), replay_file) != strlen(CAPTURE_MAGIC) ||
+        memcmp(magic, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        exit(1);
+    }
+
+    replay_have  = (fread(&replay_rec, sizeof(cap_rec_t), 1, replay_file) == 1);
+    replay_t0    = replay_rec.t_us;
+    replay_start = micros();
+}
+
+
+
+/*
+    Play every frame that's due (at most one, if fast), and read what
+    came back.  Returns 0 once the capture is done and everything it
+    started - sequences, acks, output - has run its course.
+*/
+int replay(fd_set *open_sockets, event_t *events) {
+
+    int played = 0;
+
+    while (replay_have && !(REPLAY_FAST && played)) {
+
+        cap_rec_t *rec = &replay_rec;
+
+        if (!REPLAY_FAST && rec->t_us - replay_t0 > micros() - replay_start)
+            break;
+
+        int fd = rec->fd;
+        if (fd < 0 || fd >= FD_SETSIZE || rec->len > BUFLEN ||
+            fread(replay_data, 1, rec->len, replay_file) != rec->len) {
+            replay_have = 0;
+            break;
+        }
+
+        if (rec->kind == CAP_OPEN) {
+
+            int sv[2];
+            if (replay_peer[fd]) replay_close(fd);
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 || sv[0] >= FD_SETSIZE) {
+                error("replay socketpair");
+            }
+            replay_sock[fd] = sv[0];
+            replay_peer[fd] = sv[1];
+            replay_hash[fd] = 2166136261U;
+            add_socket(sv[0], open_sockets);
+            replay_data[rec->len] = '\0';
+            snprintf(conns[sv[0]].ip, sizeof(conns[sv[0]].ip), "%.*s", (int)sizeof(conns[sv[0]].ip)-1, replay_data);  // as acceptSK() keeps it
+            replay_conns++;
+
+        } else if (rec->kind == CAP_DATA && replay_peer[fd]) {
+
+            if (send(replay_peer[fd], replay_data, rec->len, MSG_NOSIGNAL) > 0)
+                replay_bytes += rec->len;
+
+        } else if (rec->kind == CAP_CLOSE && replay_peer[fd]) {
+
+            replay_drain(fd);
+            replay_close(fd);
+        }
+
+        replay_frames++;
+        played++;
+        replay_have = (fread(&replay_rec, sizeof(cap_rec_t), 1, replay_file) == 1);
+    }
+
+    replay_drain(-1);
+
+    if (replay_have) return 1;
+
+    if (!replay_done) replay_done = millis();
+
+    return (events != NULL || num_pending || num_dirty || millis() - replay_done < REPLAY_DRAIN);
+}
+
+
+
+/* read (and hash) what the server sent to one captured connection, or all of them (-1) */
+void replay_drain(int which) {
+
+    char buf[BUFLEN];
+    int  fd, i, rc;
+
+    for (fd = (which < 0 ? 0 : which); fd < (which < 0 ? FD_SETSIZE : which+1); fd++) {
+
+        if (!replay_peer[fd]) continue;
+
+        while ((rc = recv(replay_peer[fd], buf, BUFLEN, MSG_DONTWAIT)) > 0) {
+            for (i=0; i<rc; i++)
+                replay_hash[fd] = (replay_hash[fd] ^ (unsigned char)buf[i]) * 16777619U;
+            replay_out += rc;
+        }
+    }
+}
+
+
+
+/* the captured connection closed - close our end, and fold its output into the digest */
+void replay_close(int fd) {
+
+    close(replay_peer[fd]);
+    replay_digest += replay_hash[fd] * (uint32_t)(fd*2 + 1);
+    replay_peer[fd] = 0;
+    replay_sock[fd] = 0;
+}
+
+
+
+/* how did it go? */
+void replay_report() {
+
+    int fd, c;
+
+    replay_drain(-1);
+    for (fd=0; fd<FD_SETSIZE; fd++)
+        if (replay_peer[fd]) replay_close(fd);
+
+    double secs = (micros() - replay_start)/1e6;
+
+    printf("replayed:      %ld frames, %ld bytes, %ld connections, in %.3f s (%s)\n",
+           replay_frames, replay_bytes, replay_conns, secs, REPLAY_FAST ? "fast" : "real speed");
+    printf("messages in:   %ld  (%.0f/s)\n", STAT_GET(stats.msgs_in), STAT_GET(stats.msgs_in)/secs);
+    printf("messages out:  %ld, in %ld sends, %ld dropped\n",
+           STAT_GET(stats.msgs_out), STAT_GET(stats.sends), STAT_GET(stats.drops));
+    printf("output:        %ld bytes, digest %08x\n", replay_out, replay_digest);
+
+    for (c=0; c<LAT_CLASSES; c++) {
+        hdr_t *h = &latency[c][LAT_LAST];
+        if (!h->count) continue;
+        printf("%-12s   %ld timed, read>last send us: p50 %ld  p99 %ld  max %ld\n", lat_class[c],
+               h->count, hdr_percentile(h, 50.0), hdr_percentile(h, 99.0), h->max);
+    }
+    fflush(stdout);
+}
+
 
-            } // end while < BUFLEN
 
-        } // end if rc or partial
 
-    } // end while there's a buffer or a partial
+/* METRICS ROUTINES  */
 
-    return my_events;
+/*
+    Optional (-m port) HTTP listener serving Prometheus text format, so
+    the monitoring stack can scrape us without speaking the effect
+    protocol.  It lives in the same select() as everything else, but is
+    served last in each pass, at most METRICS_PER_PASS requests a pass,
+    over non-blocking sockets - a slow or stuck scraper just waits.
+*/
 
-} // end readBuffer
 
+/* get and bind the metrics listener */
+void getMetricsSock(fd_set *open_sockets) {
 
+    struct sockaddr_in  sa;
+    int                 flag = 1;
+    int                 ms   = socket(AF_INET, SOCK_STREAM, 0);
 
+    if (ms < 0) error("metrics socket: allocation failed");
 
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_port        = htons(METRICS_PORT);
+    sa.sin_addr.s_addr = INADDR_ANY;
 
+    setsockopt(ms, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(int));
+    if (bind(ms, (struct sockaddr *)&sa, sizeof(sa))) error("metrics bind");
+    if (listen(ms, 5))                                error("metrics listen");
+    fcntl(ms, F_SETFL, O_NONBLOCK);
 
+    metrics_listen = ms;
+    conns[ms].kind = CONN_METRICS_LISTEN;
+    FD_SET(ms, open_sockets);
+    if (ms > max_socket) max_socket = ms;
+}
 
-/* given an incoming message, do the right thing with that message */
-event_t *processMsg(int socket, msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
 
-    event_t *timed_sequence;
-    timed_sequence = NULL;
 
+/* accept scrapers, answer requests, and keep writing answers too big to go at once */
+void serve_metrics(fd_set *readable_sockets, fd_set *writeable_sockets, fd_set *open_sockets, hash_table_t *hashtable) {
 
-    // skip mal-formed messages (no message at all/no identifier, no socket?)
-    if (!my_msg || !my_msg->whosTalking)
-        return NULL;
+    int  i, served = 0;
+    char req[BUFLEN];
 
-    // show message if debugging
-    if (DEBUG) {
-        cur_time();
-        printf("->  EFFECT:%s socket#:%02d msg1:'%s' msg2:'%s' msg3:'%s' msg4:'%s' \n",
-	my_msg->effectName,socket,my_msg->firstMsg,my_msg->secondMsg,my_msg->thirdMsg,my_msg->fourthMsg);
-        fflush(stdout); 
-    }
+    for (i=firstSocket+1; i<max_socket+1; i++) {
 
-    // no need to process empty messages or keep alive signals
-    if (my_msg->firstMsg == NULL || (my_msg->firstMsg && strcmp(my_msg->firstMsg,KeepAlive)==0))  
-        return NULL; 
+        conn_t *conn = &conns[i];
 
+        if (conn->kind == CONN_METRICS_LISTEN && FD_ISSET(i, readable_sockets)) {
 
-    if (strcmp(my_msg->firstMsg,CONTROL)==0) {
+            int ms = accept(i, NULL, NULL);
+            if (ms < 0) continue;
+            if (ms >= FD_SETSIZE) { close(ms); continue; }
+            fcntl(ms, F_SETFL, O_NONBLOCK);
+            memset(&conns[ms], 0, sizeof(conn_t));
+            conns[ms].kind = CONN_METRICS;
+            FD_SET(ms, open_sockets);
+            if (ms > max_socket) max_socket = ms;
 
-        // Handle a "control" message.
-        timed_sequence = doControl(my_msg, open_sockets, hashtable);
+        } else if (conn->kind == CONN_METRICS) {
 
-    } else if (strcmp(my_msg->effectName,BUTTON)==0) {
+            // a request - whatever it asks for, it gets the metrics
+            if (!conn->resp && FD_ISSET(i, readable_sockets) && served < METRICS_PER_PASS) {
 
-       // Handle a message from the button
-        timed_sequence = doButton(my_msg, open_sockets, hashtable);
+                if (read(i, req, sizeof(req)) < 1) { forceCloseSK(i, open_sockets); continue; }
 
-    } else if (my_msg->firstMsg != NULL) {
-    
-        /*
-           All other messages currently wind up here.
-           If the incoming message is from an effect that has a
-           collection, we send the firstMsg on to that collection.
+                char *body = build_metrics(hashtable);
+                if (body == NULL) { forceCloseSK(i, open_sockets); continue; }
 
-           Otherwise, we currently do nothing.
-        */
+                int blen = strlen(body);
+                conn->resp = malloc(blen + 128);
+                if (conn->resp == NULL) { free(body); forceCloseSK(i, open_sockets); continue; }
 
-        list_t *self = lookup_effect(hashtable, my_msg->effectName);
+                conn->resp_len = sprintf(conn->resp,
+                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %d\r\nConnection: close\r\n\r\n%s", blen, body);
+                conn->resp_off = 0;
+                free(body);
+                served++;
+                STAT_ADD(stats.scrapes, 1);
+            }
 
-        if (self->collection != NULL) 
-            send_to_collection(my_msg, self, open_sockets, hashtable);
-            
-    } // end there's a message
+            // write what we can, close when done
+            if (conn->resp && FD_ISSET(i, writeable_sockets)) {
+                int rc = send(i, conn->resp + conn->resp_off, conn->resp_len - conn->resp_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (rc > 0) conn->resp_off += rc;
+                if (conn->resp_off >= conn->resp_len || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                    forceCloseSK(i, open_sockets);
+            }
+        }
+    }
+}
 
 
-    return timed_sequence;
 
-} // end processMsg
+/* the metrics themselves, in prometheus text format (caller frees) */
+char *build_metrics(hash_table_t *hashtable) {
+
+    static const long le[] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000 };
+    const int  num_le      = sizeof(le)/sizeof(le[0]);
+
+    sb_t     sb = { NULL, 0, 0 };
+    int      i, c, m, b;
+    long     queued = 0L;
+    list_t  *effect;
+
+    for (i=0; i<num_dirty; i++)
+        queued += conns[dirty[i]].out_len;
+
+    sb_printf(&sb, "# TYPE xc_uptime_seconds gauge\nxc_uptime_seconds %ld\n", millis()/1000L);
+    sb_printf(&sb, "# TYPE xc_connections gauge\nxc_connections %ld\n", STAT_GET(stats.conns));
+    sb_printf(&sb, "# TYPE xc_effects gauge\nxc_effects %d\n", hash_table_count(hashtable));
+    sb_printf(&sb, "# TYPE xc_accepts_total counter\nxc_accepts_total %ld\n", STAT_GET(stats.accepts));
+    sb_printf(&sb, "# TYPE xc_messages_in_total counter\nxc_messages_in_total %ld\n", STAT_GET(stats.msgs_in));
+    sb_printf(&sb, "# TYPE xc_messages_out_total counter\nxc_messages_out_total %ld\n", STAT_GET(stats.msgs_out));
+    sb_printf(&sb, "# TYPE xc_sends_total counter\nxc_sends_total %ld\n", STAT_GET(stats.sends));
+    sb_printf(&sb, "# TYPE xc_bytes_in_total counter\nxc_bytes_in_total %ld\n", STAT_GET(stats.bytes_in));
+    sb_printf(&sb, "# TYPE xc_bytes_out_total counter\nxc_bytes_out_total %ld\n", STAT_GET(stats.bytes_out));
+    sb_printf(&sb, "# TYPE xc_drops_total counter\nxc_drops_total %ld\n", STAT_GET(stats.drops));
+    sb_printf(&sb, "# TYPE xc_duplicates_total counter\nxc_duplicates_total %ld\n", STAT_GET(stats.dups));
+    sb_printf(&sb, "# TYPE xc_idle_closed_total counter\nxc_idle_closed_total %ld\n", STAT_GET(stats.evictions));
+    sb_printf(&sb, "# TYPE xc_resumes_total counter\nxc_resumes_total %ld\n", STAT_GET(stats.resumes));
+    sb_printf(&sb, "# TYPE xc_stream_coalesced_total counter\nxc_stream_coalesced_total %ld\n", STAT_GET(stats.coalesced));
+    sb_printf(&sb, "# TYPE xc_suppressed_total counter\nxc_suppressed_total %ld\n", STAT_GET(stats.suppressed));
+    sb_printf(&sb, "# TYPE xc_queued_bytes gauge\nxc_queued_bytes %ld\n", queued);
+    sb_printf(&sb, "# TYPE xc_acks_pending gauge\nxc_acks_pending %d\n", num_pending);
+    sb_printf(&sb, "# TYPE xc_sched_backlog gauge\nxc_sched_backlog %ld\n", STAT_GET(stats.sched_backlog));
+    sb_printf(&sb, "# TYPE xc_scrapes_total counter\nxc_scrapes_total %ld\n", STAT_GET(stats.scrapes));
+
+    sb_printf(&sb, "# TYPE xc_allocs_total counter\n");
+    sb_printf(&sb, "xc_allocs_total{type=\"node\"} %ld\n",  STAT_GET(stats.node_allocs));
+    sb_printf(&sb, "xc_allocs_total{type=\"msg\"} %ld\n",   STAT_GET(stats.msg_allocs));
+    sb_printf(&sb, "xc_allocs_total{type=\"event\"} %ld\n", STAT_GET(stats.event_allocs));
+    sb_printf(&sb, "# TYPE xc_frees_total counter\n");
+    sb_printf(&sb, "xc_frees_total{type=\"node\"} %ld\n",   STAT_GET(stats.node_frees));
+    sb_printf(&sb, "xc_frees_total{type=\"msg\"} %ld\n",    STAT_GET(stats.msg_frees));
+    sb_printf(&sb, "xc_frees_total{type=\"event\"} %ld\n",  STAT_GET(stats.event_frees));
+
+    // per effect.  names are ours to choose, but escape quotes and backslashes anyway
+    sb_printf(&sb, "# TYPE xc_effect_connected gauge\n# TYPE xc_effect_messages_in_total counter\n"
+                   "# TYPE xc_effect_messages_out_total counter\n# TYPE xc_effect_drops_total counter\n"
+                   "# TYPE xc_effect_rtt_seconds gauge\n# TYPE xc_effect_loss_ratio gauge\n");
+    for (i=0; i<hashtable->size; i++) {
+        for (effect = hashtable->table[i]; effect != NULL; effect = effect->next) {
+
+            char  name[64];
+            char *e = effect->effect;
+            int   n = 0;
+            while (*e && n < (int)sizeof(name)-2) {
+                if (*e == '"' || *e == '\\') name[n++] = '\\';
+                name[n++] = *e++;
+            }
+            name[n] = '\0';
 
+            conn_t *conn = &conns[effect->socket_num];
+            int     on   = (effect->socket_num != 0);
 
+            sb_printf(&sb, "xc_effect_connected{effect=\"%s\"} %d\n", name, on);
+            sb_printf(&sb, "xc_effect_messages_in_total{effect=\"%s\"} %ld\n",  name, on ? conn->msgs_in  : 0L);
+            sb_printf(&sb, "xc_effect_messages_out_total{effect=\"%s\"} %ld\n", name, on ? conn->msgs_out : 0L);
+            sb_printf(&sb, "xc_effect_drops_total{effect=\"%s\"} %ld\n",        name, on ? conn->drops    : 0L);
+            sb_printf(&sb, "xc_effect_rtt_seconds{effect=\"%s\"} %.6f\n",       name, effect->srtt/1e6);
+            sb_printf(&sb, "xc_effect_loss_ratio{effect=\"%s\"} %.3f\n",        name, effect->loss/1000.0);
+        }
+    }
 
+    // latency histograms, folded into fixed buckets
+    sb_printf(&sb, "# TYPE xc_latency_seconds histogram\n");
+    for (c=0; c<LAT_CLASSES; c++) {
+        for (m=0; m<LAT_METRICS; m++) {
+
+            hdr_t *h    = &latency[c][m];
+            long   seen = 0L;
+            int    idx  = 0;
+
+            for (b=0; b<num_le; b++) {
+                // every hdr bucket whose top is at or under this bound
+                for (; idx<HDR_BUCKETS && hdr_top(idx) <= le[b]; idx++)
+                    seen += h->buckets[idx];
+                sb_printf(&sb, "xc_latency_seconds_bucket{class=\"%s\",stage=\"%s\",le=\"%g\"} %ld\n",
+                          lat_class[c], lat_metric[m], le[b]/1e6, seen);
+            }
+            sb_printf(&sb, "xc_latency_seconds_bucket{class=\"%s\",stage=\"%s\",le=\"+Inf\"} %ld\n",
+                      lat_class[c], lat_metric[m], h->count);
+            sb_printf(&sb, "xc_latency_seconds_sum{class=\"%s\",stage=\"%s\"} %.6f\n",
+                      lat_class[c], lat_metric[m], h->sum/1e6);
+            sb_printf(&sb, "xc_latency_seconds_count{class=\"%s\",stage=\"%s\"} %ld\n",
+                      lat_class[c], lat_metric[m], h->count);
+        }
+    }
 
-/* get ip address of a socket */
-char *getip(int sn) {
-    struct sockaddr_in addr;
-    socklen_t csa = sizeof(struct sockaddr_in);
-    getpeername(sn, (struct sockaddr *)&addr, &csa);
-    char *ipstr = "";
-    ipstr = strdup(inet_ntoa(addr.sin_addr));
-    return ipstr;
+    return sb.data;
 }
 
 
 
 
-/* 
-    Set the name of the effect from the message, (re)-associate 
-    with a particular socket using a hash table as an associative
-    array.
+/* ACKNOWLEDGEMENT ROUTINES  */
 
-    Force close any socket no longer associated with a particular
-    effect.
+/*
+    TCP will get a PoofOFF there eventually, but "eventually" is its
+    retransmit timer - hundreds of ms, growing - and we'd never know how
+    long it took.  So effects can ask ('effect:*:AK:1') to ack critical
+    commands.  Those go out tagged with an id, and we keep a rolling
+    round trip time (srtt/rttvar, same as TCP does) and loss estimate per
+    effect.  Anything not acked within srtt + 4*rttvar is resent from
+    the main loop, with the same id, up to ACK_TRIES times.
+
+    If the effect drops meanwhile, they're held for RESUME_HOLD_MS, and
+    resent the moment it resumes its session (see resume_session()).
 */
-int namedSock (msg_t *my_msg, fd_set *open_sockets, fd_set *readable_sockets, fd_set *writeable_sockets, hash_table_t *hashtable) {
 
-    if (!my_msg || !my_msg->effectName || !my_msg->whosTalking) return 0;
 
-    list_t *anEffect = lookup_effect(hashtable, my_msg->effectName);
+/* commands we'd want an ack for - stops, of all of an effect or some of its channels ($c<mask>,p0%) */
+int is_critical(char *msg) {
 
-    int aSock = 0;
-  
-    if (anEffect != NULL)
-         aSock = anEffect->socket_num;
+    char *end;
 
-    if (aSock) { 
- 
-        // already have a socket for this effect
-        
-        if (aSock != my_msg->whosTalking) {
- 
-            // TWO sockets for the same effect.  Either it went offline and came back, or there's
-            // a duplicate (two same-named effects on different sockets)
-            if (strcmp(anEffect->ipadd, my_msg->ipadd)==0) {
-                forceCloseSK(aSock, open_sockets);
-                set_effect_socket(hashtable, my_msg->effectName, my_msg->whosTalking);
-                if (DEBUG) {cur_time();  printf("x   RE-CONNECT - FORCE close old socket on name:%s socket:%d, new socket:%d, ip:%s\n", 
-                   my_msg->effectName, aSock, my_msg->whosTalking, my_msg->ipadd);fflush(stdout); }
-            } else {
-                // different ips - it's a duplicate effect.
-                if (DEBUG) {cur_time();  printf("xx  DUPLICATE EFFECT!! name:%s is already on socket:%d. IGNORING THIS EFFECT!\n", 
-                   my_msg->effectName, aSock);fflush(stdout); }
-                return 0;
-            }
-        } 
-    } else { 
-   
-        // no socket found for this effect
+    if (strcmp(msg,PoofOFF)==0 || strcmp(msg,KILL_ALL)==0) return 1;
 
-        // existing effect found, update its socket
-        if (anEffect != NULL) {
-            set_effect_socket(hashtable,anEffect->effect,my_msg->whosTalking);  // update effect with new socket number
-            if (DEBUG) {cur_time();  printf("updating known effect with now known socket#:%d\n",anEffect->socket_num); fflush(stdout); }
+    if (msg[0] != '$' || msg[1] != 'c') return 0;
+    strtoul(msg+2, &end, 16);
+    return (end > msg+2 && strcmp(end, ",p0%")==0);
+}
 
-        // brand new effect, store it
-        } else {
-            if (my_msg) 
-                add_effect(hashtable, my_msg);    // new effect, add to hash table
-        }
+
+
+/* send '$<cmd>%' as '$#<id>,<cmd>%', and remember it until it's acked */
+void send_acked(list_t *self, fd_set *open_sockets, char *msg, hash_table_t *hashtable) {
+
+    char    tagged[48];
+    long    id;
+    ack_t  *slot;
+
+    // ids skip any slot that's still awaiting its ack, so it keeps being resent
+    while (num_pending < MAXPENDING && pending[(last_ack_id+1) % MAXPENDING].id)
+        last_ack_id++;
+
+    id   = ++last_ack_id;
+    slot = &pending[id % MAXPENDING];
+
+    // every slot taken - the one we land on is lost, but not without a word
+    if (slot->id) {
+        LOG(LV_ERROR, "xx  %d acks pending - gave up on '%s' id:%ld to %s, after %d tries\n",
+                     MAXPENDING, slot->cmd, slot->id, slot->effect->effect, slot->tries);
+        slot->effect->loss = (slot->effect->loss*7 + 1000)/8;
+        num_pending--;
     }
 
-    return 1;
+    slot->id         = id;
+    slot->effect     = self;
+    slot->tries      = 1;
+    slot->first_sent = micros();
+    slot->last_sent  = slot->first_sent;
+    slot->rto        = self->srtt ? self->srtt + 4*self->rttvar : 5*ACK_MIN_RTO;
+    if (slot->rto < ACK_MIN_RTO) slot->rto = ACK_MIN_RTO;
+    if (slot->rto > ACK_MAX_RTO) slot->rto = ACK_MAX_RTO;
+    snprintf(slot->cmd, sizeof(slot->cmd), "%.*s", (int)strlen(msg)-2, msg+1);
+    num_pending++;
+
+    snprintf(tagged, sizeof(tagged), "$#%ld,%s%%", id, slot->cmd);
+    queue_msg(self->socket_num, tagged, strlen(tagged)+1, open_sockets, hashtable);
+}
 
-} // end namedSock
 
 
+/* 'effect:*:OK:<id>' - a critical command made it */
+void got_ack(msg_t *my_msg, hash_table_t *hashtable) {
 
+    if (my_msg->thirdMsg == NULL) return;
 
-/* 
-    Send messages out.  Confirm socket is open and ready.
-    Note that we just close any socket that can't accept messages.
-*/
-void send_msg (list_t *my_element, fd_set *open_sockets, char *msg, hash_table_t *hashtable) {
+    long       id   = atol(my_msg->thirdMsg);
+    ack_t     *slot = &pending[id % MAXPENDING];
+    list_t    *self;
 
-    int   sock   = my_element->socket_num;
-    char *effect = my_element->effect;
+    if (id < 1 || slot->id != id) return;       // late ack for something we gave up on, or a dup
 
-    if (!sock) { return; }
- 
-    if (FD_ISSET(sock, open_sockets)) { 
-        int nBytes = strlen(msg) + 1;
-        if (!my_element->do_not_send) {
-//long now = millis();
-//long diff = now - last_now;
-//printf("now:%ld   diff:%ld\n",now,diff);
-//last_now = now;
-            int bsent = send(sock, msg, nBytes, MSG_NOSIGNAL);
-            if (DEBUG) { cur_time(); printf("<-  sent message:'%s' to %10s on socket:%02d  bytes sent:%d\n",msg,effect,sock,bsent); fflush(stdout); }
+    self = slot->effect;
+    if (lookup_effect(hashtable, my_msg->effectName) != self || self->socket_num != my_msg->whosTalking)
+        return;                                 // not who we sent it to - theirs is still pending
+
+    // only time the first send (Karn) - otherwise we can't tell which one was acked
+    if (slot->tries == 1) {
+        long rtt = (long)(micros() - slot->first_sent);
+        if (!self->srtt) {
+            self->srtt   = rtt;
+            self->rttvar = rtt/2;
         } else {
-            if (DEBUG) { cur_time(); printf("xx  skipped message:'%s' to %10s on socket:%02d (dns set)\n",msg,effect,sock); fflush(stdout); }
+            self->rttvar = (3*self->rttvar + labs(self->srtt - rtt))/4;
+            self->srtt   = (7*self->srtt + rtt)/8;
         }
-    } else { // close any unavailable socket
-        closeSK(sock, open_sockets, hashtable);
-        if (DEBUG) { cur_time(); printf("x   closing socket:%d, can't write\n",sock);fflush(stdout); }
     }
+
+    self->loss = (self->loss*7)/8;
+    self->acked++;
+
+    LOG(LV_DEBUG, "->  ack id:%ld from %s, tries:%d  srtt:%ldus rttvar:%ldus loss:%d/1000\n",
+                 id, self->effect, slot->tries, self->srtt, self->rttvar, self->loss);
+
+    slot->id = 0;
+    num_pending--;
 }
 
 
 
+/* resend anything that's waited too long for its ack */
+void check_acks(fd_set *open_sockets, hash_table_t *hashtable) {
 
-/*     Send message to all active sockets (self is ignored).   */
-void send_all(int whosTalking, fd_set *open_sockets, hash_table_t *hashtable, char *my_msg) {
-    sendto_msg_list(whosTalking, get_all_nodes(hashtable), open_sockets, hashtable, my_msg);
-}
+    int        i;
+    long long  now;
+    ack_t     *slot;
+    char       tagged[48];
 
+    if (!num_pending) return;
 
+    now = micros();
 
+    for (i=0; i<MAXPENDING; i++) {
 
-/* process incoming control message */
-event_t *doControl(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable) {
+        slot = &pending[i];
+        if (!slot->id) continue;
 
-    event_t *timed_sequence;
-    timed_sequence = NULL;
+        // just resumed - resend now, it may well have died with the old socket
+        int resumed = slot->effect->resumed > slot->last_sent;
 
-    if (strcmp(my_msg->secondMsg,XX)==0) {         // kill all!
-        send_all(my_msg->whosTalking, open_sockets, hashtable, KILL_ALL);
-    } else if (strcmp(my_msg->secondMsg,RO)==0) {  // setting round order
-        set_list_order(hashtable, my_msg);
-    } else if (strcmp(my_msg->secondMsg,CC)==0) {  // creating a collection
-        set_collection(hashtable, my_msg);
-    } else if (strcmp(my_msg->secondMsg,DS)==0) {  // don't-send flag
-        set_effect_ds(hashtable, my_msg->effectName, my_msg->thirdMsg);
-    } else {
-        // more eventually....
+        if (!resumed && now - slot->last_sent < slot->rto) continue;
 
-        // look for incoming timed sequence and parse here?
-    }
+        // dropped - hold it a while, in case the effect resumes
+        if (!slot->effect->socket_num && now - slot->first_sent < RESUME_HOLD_MS*1000LL) continue;
 
-    return timed_sequence;
-}
+        if (!resumed)
+            slot->effect->loss = (slot->effect->loss*7 + 1000)/8;
+
+        // gone, or given up on
+        if (!slot->effect->socket_num || slot->tries >= ACK_TRIES) {
+            LOG(LV_ERROR, "xx  no ack for '%s' id:%ld from %s after %d tries\n",
+                         slot->cmd, slot->id, slot->effect->effect, slot->tries);
+            slot->id = 0;
+            num_pending--;
+            continue;
+        }
 
+        slot->tries++;
+        slot->last_sent = now;
+        slot->rto       = (2*slot->rto > ACK_MAX_RTO) ? ACK_MAX_RTO : 2*slot->rto;
+        slot->effect->resent++;
 
+        snprintf(tagged, sizeof(tagged), "$#%ld,%s%%", slot->id, slot->cmd);
+        queue_msg(slot->effect->socket_num, tagged, strlen(tagged)+1, open_sockets, hashtable);
+        flush_sock(slot->effect->socket_num, open_sockets, hashtable);
 
+        LOG(LV_DEBUG, "<-  resent '%s' id:%ld to %s, try:%d\n", slot->cmd, slot->id, slot->effect->effect, slot->tries);
+    }
+}
 
 
 
@@ -1124,12 +5780,17 @@ event_t *new_event(char *str, long begin, long length, list_t *collection, long
 
     // allocate memory 
     if ((new_event  = (event_t *)malloc(sizeof(event_t))) == NULL) return NULL;
+    STAT_ADD(stats.event_allocs, 1);
 
     // Populate data
     new_event->action       = strdup(str);          // explicity copy original into memory 
     new_event->begin        = begin + seq_start;
     new_event->length       = length;
     new_event->started      = 0;
+    new_event->shipped      = 0;
+    new_event->msg          = NULL;
+    new_event->target       = NULL;
+    new_event->from         = 0;
 
     // linked lists
     new_event->next         = NULL;
@@ -1141,12 +5802,18 @@ event_t *new_event(char *str, long begin, long length, list_t *collection, long
 
 
 
-/* check all events in the current timed sequence */
-event_t *check_events(event_t *events, long seq_start, fd_set *open_sockets, hash_table_t *hashtable) {
+/* 
+    check all events in the current timed sequence.  
+    note event->begin is already absolute (see new_event()).
+*/
+event_t *check_events(event_t *events, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    STAT_SET(stats.sched_backlog, 0);
 
     if (events == NULL) return NULL;
 
-    long     now = millis();
+    long     now     = millis();
+    long     backlog = 0L;
 
     list_t  *this_node;
     event_t *this_event, *last_event, *drop_event, *head;
@@ -1159,28 +5826,42 @@ event_t *check_events(event_t *events, long seq_start, fd_set *open_sockets, has
     
         drop_event = NULL;
 
-        if ( now > (seq_start + this_event->begin) && !this_event->started ) {
+        // coming up soon - clock-synced effects get it now
+        if ( !this_event->shipped && now > (this_event->begin - SYNC_LEAD) ) 
+            ship_event(this_event, open_sockets, hashtable);
+
+        if ( now > this_event->begin && !this_event->started ) {
 
-            // begin action
+            // begin action (already done, if shipped ahead)
+            lat_begin(LAT_SCHEDULED, 1000LL*this_event->begin);
+            if (this_event->msg)        // a rule's delayed send
+                rule_send(this_event->target, this_event->msg, this_event->from, open_sockets, hashtable);
             this_node = this_event->collection;
             while (this_node != NULL) {
-                if (strcmp(this_event->action,"poof") == 0) {
-                    send_msg(this_node, open_sockets, PoofON, hashtable);
+                if (strcmp(this_event->action,"poof") == 0 && !this_node->shipped) {
+                    send_to(this_node, open_sockets, PoofON, hashtable);
                 }
                 this_node = this_node->next;
             }
             this_event->started = 1;
+            lat_end();
 
-        } else if ( now > (seq_start + this_event->begin + this_event->length) ) {
+        } else if ( now > (this_event->begin + this_event->length) ) {
 
-            // complete action
+            // complete action.  shipped effects get the (same) timed OFF
+            // again, in case the first was lost - it's ignored if not.
+            lat_begin(LAT_SCHEDULED, 1000LL*(this_event->begin + this_event->length));
             this_node = this_event->collection;
             while (this_node != NULL) {
                 if (strcmp(this_event->action,"poof") == 0) {
-                    send_msg(this_node, open_sockets, PoofOFF, hashtable);
+                    if (this_node->shipped)
+                        send_timed(this_node, open_sockets, 1000LL*(this_event->begin + this_event->length), PoofOFF, hashtable);
+                    else
+                        send_to(this_node, open_sockets, PoofOFF, hashtable);
                 }
                 this_node = this_node->next;
             }
+            lat_end();
 
             // drop this event from the list
             if (last_event != NULL) {
@@ -1212,9 +5893,12 @@ event_t *check_events(event_t *events, long seq_start, fd_set *open_sockets, has
         } else {
             last_event = this_event;
             this_event = this_event->next;
+            backlog++;
         }
  
     }
+
+    STAT_SET(stats.sched_backlog, backlog);
     
     // returns an ever smaller list, eventually null
     return head;
@@ -1223,6 +5907,34 @@ event_t *check_events(event_t *events, long seq_start, fd_set *open_sockets, has
 
 
 
+/* 
+    ship an event ahead of time, as timed ON and OFF commands, to
+    each effect in its collection that keeps our clock. 
+*/
+void ship_event(event_t *event, fd_set *open_sockets, hash_table_t *hashtable) {
+
+    list_t *this_node, *self;
+
+    event->shipped = 1;
+
+    if (strcmp(event->action,"poof") != 0) return;
+
+    for (this_node = event->collection; this_node != NULL; this_node = this_node->next) {
+
+        self = lookup_effect(hashtable, this_node->effect);
+        if (self == NULL || !self->synced || !self->socket_num || this_node->chans) continue;
+
+        this_node->socket_num = self->socket_num;
+        this_node->shipped    = 1;
+
+        send_timed(this_node, open_sockets, 1000LL*event->begin, PoofON, hashtable);
+        send_timed(this_node, open_sockets, 1000LL*(event->begin + event->length), PoofOFF, hashtable);
+    }
+}
+
+
+
+
 /*
     appends second eventlist to first by iterating through the first.
     thus, faster if the first event list is the short one.
@@ -1359,7 +6071,7 @@ event_t *doButton(msg_t *my_msg, fd_set *open_sockets, hash_table_t *hashtable)
 /*  Go around in a "circle" several times, faster, then big finish */
 event_t *bigRound(int whosTalking, fd_set *open_sockets, hash_table_t *hashtable) {
 
-    if (DEBUG) { cur_time(); printf("\tLet's Have a big ROUND!!\n");  fflush(stdout); }
+    LOG(LV_INFO, "\tLet's Have a big ROUND!!\n");
 
     list_t *all_elements =  get_ordered_list(hashtable);
     int poof_time = ROpoofLength;
@@ -1499,6 +6211,37 @@ event_t *lulu_poof(list_t *my_element, long *begin) {
 /******  UTILITIES **********/
 
 
+/*  printf onto the end of a growing string buffer  */
+void sb_printf(sb_t *sb, const char *fmt, ...) {
+
+    va_list ap;
+    int     need;
+
+    va_start(ap, fmt);
+    need = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (need < 0) return;
+
+    if (sb->len + need + 1 > sb->size) {
+        int   size = (sb->size ? sb->size*2 : 4096);
+        while (size < sb->len + need + 1) size *= 2;
+        char *data = realloc(sb->data, size);
+        if (data == NULL) return;
+        sb->data = data;
+        sb->size = size;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(sb->data + sb->len, sb->size - sb->len, fmt, ap);
+    va_end(ap);
+
+    sb->len += need;
+}
+
+
+
+
 /*  error - wrapper for perror */
 void error(char *msg) {
 	perror(msg);
@@ -1511,44 +6254,33 @@ void error(char *msg) {
 /* set and keep the current time since process start, in millisenconds */
 long millis(void) {
 
-    struct timespec spec;    // posix time struct
-    time_t          s;       // second component
-    long ms;      // millisecond component
+    current_time = (long)(micros() / 1000LL);
+       
+    return current_time;
 
-    long            millis;  // time in milliseconds
+} // end millis
 
-    clock_gettime(CLOCK_REALTIME, &spec);
 
-    s  = spec.tv_sec;
-    ms = spec.tv_nsec / 1.0e6; // Convert nanoseconds to milliseconds
-    if (ms>999) {
-       s++;
-       ms = 0;
-    }
 
-    /*printf("Current time: %"PRIdMAX".%03ld seconds since the Epoch.  ms:%ld\n",
-           (intmax_t)s, ms, ms);*/
-    if (!start_time) {
-        start_time   = s;
-        start_ms     = ms;
-        return 0L;
-    } 
+/* 
+    microseconds since process start.  monotonic, so the clock
+    effects sync to (and our sequences) never jump.
+*/
+long long micros(void) {
 
-    millis = (s-start_time)*1000 + (ms-start_ms);
-  
-    current_time = millis;
-       
-    return current_time;
+    struct timespec spec;    // posix time struct
+    long long       now;
 
-} // end millis
+    clock_gettime(CLOCK_MONOTONIC, &spec);
 
+    now = (long long)spec.tv_sec*1000000LL + spec.tv_nsec/1000;
 
+    if (!start_us) 
+        start_us = now;
 
+    return now - start_us;
 
-/* prints the time , mostly for debugging*/
-void cur_time (void) {
-    printf("%ld  ", millis());
-}
+} // end micros
 
 
 
@@ -1572,7 +6304,7 @@ void delay_micro (unsigned int howLong) {
   struct timespec sleeper, dummy ;
 
   sleeper.tv_sec  = (time_t)(howLong / 1000000) ;
-  sleeper.tv_nsec = (long)(howLong % 1000000) * 1000000 ;
+  sleeper.tv_nsec = (long)(howLong % 1000000) * 1000 ;
 
   nanosleep (&sleeper, &dummy) ;
 }
@@ -1663,7 +6395,7 @@ void sendto_msg_list(int whosTalking, list_t *all_effects, fd_set *open_sockets,
     while (all_effects != NULL) {
 
         if (all_effects->socket_num != whosTalking) 
-            send_msg(all_effects, open_sockets, msg, hashtable);
+            send_to(all_effects, open_sockets, msg, hashtable);
 
         all_effects = all_effects->next;
 
@@ -1677,10 +6409,143 @@ void sendto_msg_list(int whosTalking, list_t *all_effects, fd_set *open_sockets,
 /*    Send a message to a collection - a set of effects to which a given effect broadcasts */
 void send_to_collection(msg_t *my_msg, list_t *self, fd_set *open_sockets, hash_table_t *hashtable) {
 
-    if (self->c_mod != hashtable->modified)
-        update_collection(hashtable, self);
+    list_t *member;
+    fd_set  sent;
+
+    // no memory for the bitset - better it goes nowhere than to everyone
+    if (self->cset_gen != eff_gen && !collection_ids(hashtable, self)) {
+        LOG(LV_ERROR, "x   no memory for %s's collection, message not sent\n", self->effect);
+        return;
+    }
+
+    FD_ZERO(&sent);
+    send_ids(self->cset, self->cset_words, 0, self->socket_num, open_sockets, my_msg->firstMsg, hashtable,
+             self->topics ? &sent : NULL);
+
+    // sub-channels and topics go by name
+    if (self->cchans) {
+        if (self->c_mod != hashtable->modified)
+            update_collection(hashtable, self);
+        for (member = self->collection; member != NULL; member = member->next)
+            if (member->chans && member->socket_num != self->socket_num)
+                send_to(member, open_sockets, my_msg->firstMsg, hashtable);
+    }
+
+    if (self->topics) {
+        for (member = self->collection; member != NULL; member = member->next)
+            if (strchr(member->effect, '/'))
+                publish(self->socket_num, member->effect, my_msg->firstMsg, open_sockets, hashtable, &sent);
+    }
+}
+
+
 
-    sendto_msg_list(self->socket_num, self->collection, open_sockets, hashtable, my_msg->firstMsg);
+
+/* work out the bitset of a collection's members - all but sub-channels and topics.  0 if there's no memory */
+int collection_ids(hash_table_t *hashtable, list_t *self) {
+
+    list_t *member, *eff;
+    int     words = eff_cap / 64;
+
+    if (self->cset_words < words) {
+        free(self->cset);
+        if ((self->cset = malloc(words * sizeof(uint64_t))) == NULL) {
+            self->cset_words = 0;
+            return 0;
+        }
+        self->cset_words = words;
+    }
+    memset(self->cset, 0, self->cset_words * sizeof(uint64_t));
+    self->cchans = 0;
+
+    for (member = self->collection; member != NULL; member = member->next) {
+        if (member->chans)
+            self->cchans = 1;
+        else if ((eff = lookup_effect(hashtable, member->effect)) != NULL && eff->id >= 0)
+            self->cset[eff->id >> 6] |= 1ULL << (eff->id & 63);
+    }
+
+    self->cset_gen = eff_gen;
+    return 1;
+}
+
+
+
+
+/*
+    Send msg to the effects in set (words long - or, if all, every one)
+    that are online and not DS, but not the one on socket whosTalking.
+    Their sockets go in sent, if given.
+*/
+void send_ids(uint64_t *set, int words, int all, int whosTalking, fd_set *open_sockets, char *msg, hash_table_t *hashtable, fd_set *sent) {
+
+    uint64_t w;
+    int      i, id, me = -1;
+
+    if (whosTalking >= 0 && whosTalking < FD_SETSIZE && conns[whosTalking].effect)
+        me = conns[whosTalking].effect->id;
+
+    if (!all && set == NULL) return;
+
+    if (all || words > eff_cap / 64)
+        words = eff_cap / 64;
+
+    for (i = 0; i < words; i++) {
+        w = (all ? ~0ULL : set[i]) & eff_online[i] & ~eff_ds[i];
+        if (me >> 6 == i)
+            w &= ~(1ULL << (me & 63));
+        for (; w; w &= w - 1) {
+            id = i*64 + __builtin_ctzll(w);
+            send_msg(eff_node[id], open_sockets, msg, hashtable);
+            if (sent && eff_node[id]->socket_num)
+                FD_SET(eff_node[id]->socket_num, sent);
+        }
+    }
+}
+
+
+
+
+/* give a new effect (node in the table) an id - 0, or -1 if there's no room */
+int eff_add(list_t *node) {
+
+    if (eff_count == eff_cap) {
+        int       cap    = eff_cap ? 2*eff_cap : 64;
+        list_t  **nodes  = realloc(eff_node, cap * sizeof(list_t *));
+        if (nodes) eff_node = nodes;
+        uint64_t *online = realloc(eff_online, cap/64 * sizeof(uint64_t));
+        if (online) eff_online = online;
+        uint64_t *ds     = realloc(eff_ds, cap/64 * sizeof(uint64_t));
+        if (ds) eff_ds = ds;
+        if (!nodes || !online || !ds) return -1;
+        memset(eff_online + eff_cap/64, 0, (cap - eff_cap)/64 * sizeof(uint64_t));
+        memset(eff_ds + eff_cap/64, 0, (cap - eff_cap)/64 * sizeof(uint64_t));
+        eff_cap = cap;
+    }
+
+    node->id            = eff_count++;
+    eff_node[node->id]  = node;
+    eff_gen++;
+    eff_sync(node);
+
+    return 0;
+}
+
+
+
+/* an effect's socket or DS changed - copy it to the bitsets */
+void eff_sync(list_t *node) {
+
+    uint64_t bit = 1ULL << (node->id & 63);
+    int      i   = node->id >> 6;
+
+    if (node->id < 0) return;
+
+    if (node->socket_num)  eff_online[i] |=  bit;
+    else                   eff_online[i] &= ~bit;
+
+    if (node->do_not_send) eff_ds[i] |=  bit;
+    else                   eff_ds[i] &= ~bit;
 }
 
 
@@ -1693,11 +6558,13 @@ void set_collection(hash_table_t *hashtable, msg_t *my_msg) {
     list_t  *collection;
     char    *str = my_msg->thirdMsg;
 
-    collection       = get_list(hashtable, str); 
     self             = lookup_effect(hashtable, my_msg->effectName);
+    self->topics     = (str && strchr(str, '/'));       // (before get_list() cuts it up)
+    collection       = get_list(hashtable, str); 
     self->collection = collection;
 
     self->c_mod      = hashtable->modified;
+    self->cset_gen   = -1;
 }
 
 
@@ -1811,6 +6678,12 @@ list_t *get_list(hash_table_t *hashtable, char *input) {
 
     while (part != NULL) {
 
+        // some of an effect's sub-channels?  ("ORGAN->3+4")
+        uint32_t chans = 0;
+        char    *arrow = strstr(part, ARROW);
+        if (arrow && chan_parse(arrow + 2, &chans) == 0) 
+            *arrow = '\0';
+
         effect = lookup_effect(hashtable, part);
 
         list_t *new_list;
@@ -1820,6 +6693,7 @@ list_t *get_list(hash_table_t *hashtable, char *input) {
         else
 
             new_list = new_node(part, 0, NULL); 
+        new_list->chans = chans;
         if (position == NULL) {
             position     = new_list;
             ordered_list = position;
@@ -1984,21 +6858,15 @@ list_t *lookup_effect(hash_table_t *hashtable, char *str) {
 /*
      look up effect by its socket number.
 
-     finding by socket number is just brute force iteration -
-     unless we create *two* hash tables - a lot of overhead.
+     namedSock() leaves the effect on the socket's conns[] entry, so no
+     search - just make sure the effect hasn't moved on to another socket.
 */
 list_t *lookup_effect_sk(hash_table_t *hashtable, int sock_num) { 
 
-    int     i;
-    list_t *list; 
+    list_t *list = conns[sock_num].effect;
 
-    /* Go to the correct list based on the hash value and see if str is 
-    * in the list. If it is, return return a pointer to the list element. 
-    * If it isn't, the item isn't in the table, so return NULL. */ 
-    for(i=0; i<hashtable->size; i++) 
-        for (list = hashtable->table[i]; list != NULL; list = list->next)  
-            if (sock_num == list->socket_num)
-                return list; 
+    if (list != NULL && list->socket_num == sock_num)
+        return list; 
      
     return NULL; 
 }
@@ -2021,11 +6889,12 @@ int add_effect(hash_table_t *hashtable, msg_t *my_msg) {
 
     new_element = new_node(my_msg->effectName, my_msg->whosTalking, my_msg->ipadd);
     if (!new_element) return 1;  		// insert failed 
-    
-    if (DEBUG) {
-        printf("\n       >>>>>>>>>> ADDING EFFECT '%s' on socket:%d\n\n",my_msg->effectName,my_msg->whosTalking); 
-        fflush(stdout);
+    if (eff_add(new_element) != 0) {
+        free_node(new_element);
+        return 1;
     }
+    
+    LOG(LV_INFO, "\n       >>>>>>>>>> ADDING EFFECT '%s' on socket:%d\n\n",my_msg->effectName,my_msg->whosTalking);
 
     new_element2 = copy_node(new_element);
 
@@ -2065,16 +6934,36 @@ list_t *new_node(char* str, int sock, char *ipadd) {
 
     // allocate memory for new node
     if ((new_list  = (list_t *)malloc(sizeof(list_t))) == NULL) return NULL;
+    STAT_ADD(stats.node_allocs, 1);
 
     // Populate data
     new_list->effect          = strdup(str);          // explicity copy original into memory 
 
     if (ipadd)
         new_list->ipadd       = strdup(ipadd);        // explicity copy original into memory 
+    else
+        new_list->ipadd       = NULL;
 
     new_list->socket_num      = sock;
     new_list->do_not_send     = 0;
     new_list->c_mod           = 0L;
+    new_list->synced          = 0;
+    new_list->shipped         = 0;
+    new_list->acks            = 0;
+    new_list->srtt            = 0L;
+    new_list->rttvar          = 0L;
+    new_list->loss            = 0;
+    new_list->acked           = 0L;
+    new_list->resent          = 0L;
+    new_list->token           = 0ULL;
+    new_list->resumed         = 0LL;
+    new_list->topics          = 0;
+    new_list->chans           = 0;
+    new_list->id              = -1;
+    new_list->cset            = NULL;
+    new_list->cset_words      = 0;
+    new_list->cset_gen        = -1;
+    new_list->cchans          = 0;
 
     // linked lists
     new_list->next            = NULL;
@@ -2100,6 +6989,8 @@ list_t *copy_node(list_t *a_node) {
     new_list = new_node(a_node->effect, a_node->socket_num, a_node->ipadd);
 
     new_list->do_not_send = a_node->do_not_send;
+    new_list->synced      = a_node->synced;
+    new_list->chans       = a_node->chans;
 
     return new_list;
 }
@@ -2129,6 +7020,7 @@ void update_node(list_t *hashtable_node, list_t *collection_node) {
 
     collection_node->socket_num      = hashtable_node->socket_num; 
     collection_node->do_not_send     = hashtable_node->do_not_send;
+    collection_node->synced          = hashtable_node->synced;
  
     // now current with hashtable
     collection_node->c_mod           = hashtable_node->c_mod;                 
@@ -2150,6 +7042,7 @@ int set_effect_socket(hash_table_t *hashtable, char *str, int sock) {
 
     current_list->socket_num = sock;
     hashtable->modified      = millis();
+    eff_sync(current_list);
 
     return 0; 
 } 
@@ -2157,7 +7050,7 @@ int set_effect_socket(hash_table_t *hashtable, char *str, int sock) {
 
 
 
-/*    (re)-set socket number for an effect given original socket number   (linear fast)  */
+/*    (re)-set socket number for an effect given original socket number   (fast)  */
 int set_effect_socket_sk(hash_table_t *hashtable, int sock, int val) {
 
     list_t *current_list; 
@@ -2169,6 +7062,7 @@ int set_effect_socket_sk(hash_table_t *hashtable, int sock, int val) {
 
     current_list->socket_num = val;
     hashtable->modified      = millis();
+    eff_sync(current_list);
 
     return 0; 
 } 
@@ -2186,8 +7080,28 @@ void set_effect_ds(hash_table_t *hashtable, char *str, char *msg) {
     /* item doesn't exist */
     if (current_list == NULL) return; 
 
-    current_list->do_not_send = naive_str2int(msg);
+    current_list->do_not_send = msg ? naive_str2int(msg) : 1;     // plain DS means don't send
     hashtable->modified       = millis();
+    eff_sync(current_list);
+
+    if (current_list->socket_num)
+        estop_set(current_list->socket_num, !current_list->do_not_send);
+} 
+
+
+
+
+/*    set whether a given effect acks critical commands (hash fast)  */
+void set_effect_acks(hash_table_t *hashtable, char *str, char *msg) { 
+
+    list_t *current_list; 
+
+    current_list = lookup_effect(hashtable, str); 
+
+    /* item doesn't exist */
+    if (current_list == NULL || msg == NULL) return; 
+
+    current_list->acks = naive_str2int(msg);
 } 
 
 
@@ -2288,6 +7202,7 @@ void free_msg(msg_t *msg) {
     free(msg->fourthMsg); 
     free(msg->ipadd); 
     free(msg); 
+    STAT_ADD(stats.msg_frees, 1);
 }
 
 
@@ -2338,7 +7253,9 @@ void free_node(list_t *node) {
     free(node->effect);
     free(node->ipadd);
     free_node_list(node->collection); 
+    free(node->cset);
     free(node); 
+    STAT_ADD(stats.node_frees, 1);
 }
 
 
@@ -2361,6 +7278,9 @@ void free_event_list(event_t *head) {
 /*      frees all memory for a given event   */
 void free_event(event_t *event) {
     free(event->action);
+    free(event->msg);
+    free(event->target);
     free_node_list(event->collection); 
     free(event); 
+    STAT_ADD(stats.event_frees, 1);
 }